@@ -2,9 +2,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
+#include "otp_server.h"
+#include "otp_log.h"
+#include "otp_capture.h"
 
 // initialize decription function
 char* decript_buffer();
@@ -38,44 +43,98 @@ int main(int argc, char *argv[]){
 
   // Check usage & args
   if (argc < 2) { 
-    fprintf(stderr,"USAGE: %s port\n", argv[0]); 
+    fprintf(stderr,"USAGE: %s port [io_threads [compute_threads] | uring [workers [sqpoll]]]\n", argv[0]); 
     exit(1);
   }
   
   pid_t childpid;
+
+  // connections and errors are logged from a background thread
+  otp_log_start();
+  // with OTP_CAPTURE set, record every request for the replay tool
+  otp_capture_start();
+
+  // SIGUSR2 hands the port to a freshly started copy of this binary
+  catch_upgrade_signal();
   
-  // Create the socket that will listen for connections
-  int listenSocket = socket(AF_INET, SOCK_STREAM, 0);
-  if (listenSocket < 0) {
-    error("ERROR opening socket");
-  }
+  // a server being replaced passes its listening socket down to us
+  int listenSocket;
+  if (inherited_listen_sockets(&listenSocket, 1) < 0) {
+    // Create the socket that will listen for connections
+    listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenSocket < 0) {
+      error("ERROR opening socket");
+    }
 
-  // Set up the address struct for the server socket
-  setupAddressStruct(&serverAddress, atoi(argv[1]));
+    // Set up the address struct for the server socket
+    setupAddressStruct(&serverAddress, atoi(argv[1]));
 
-  // Associate the socket to the port
-  if (bind(listenSocket, 
-          (struct sockaddr *)&serverAddress, 
-          sizeof(serverAddress)) < 0){
-    error("ERROR on binding");
+    // Associate the socket to the port
+    if (bind(listenSocket, 
+            (struct sockaddr *)&serverAddress, 
+            sizeof(serverAddress)) < 0){
+      error("ERROR on binding");
+    }
   }
 
   // Start listening for connetions. Allow up to 5 connections to queue up
-  listen(listenSocket, 5); 
+  // unless the pool server is taking them, which can keep up with far more
+  listen(listenSocket, argc > 2 ? SOMAXCONN : 5); 
+
+  // "uring" serves from io_uring workers instead of forking
+  if (argc > 2 && strcmp(argv[2], "uring") == 0) {
+    int workers = argc > 3 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+    int sqpoll = argc > 4 ? atoi(argv[4]) : 0;
+    if (run_uring_server(listenSocket, &dec_service, workers, sqpoll, argv) < 0){
+      exit(1);
+    }
+    exit(0);
+  }
+
+  // given thread counts, serve from I/O threads and a compute pool instead of forking
+  if (argc > 2) {
+    int compute_threads = argc > 3 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+    struct otp_listener listener = { listenSocket, &dec_service };
+    if (run_pool_server(&listener, 1, NULL, 0, atoi(argv[2]), compute_threads, argv) < 0){
+      exit(1);
+    }
+    exit(0);
+  }
+
+  announce_ready();
   
   // Accept a connection, blocking if one is not available until one connects
   while(1){
+    // once the new server is accepting, stop and let the children finish
+    if (upgrade_requested){
+      upgrade_requested = 0;
+      if (hand_off_listeners(&listenSocket, 1, argv) == 0){
+        break;
+      }
+    }
+
+    // reap the children that have finished so they do not pile up as zombies
+    while (waitpid(-1, NULL, WNOHANG) > 0);
+
+    // sleep until a client connects or an upgrade is asked for
+    if (wait_for_connection(listenSocket) < 0){
+      continue;
+    }
+
     // Accept the connection request which creates a connection socket
     connectionSocket = accept(listenSocket, 
                 (struct sockaddr *)&clientAddress, 
                 &sizeOfClientInfo); 
     if (connectionSocket < 0){
-      error("ERROR on accept");
+      if (errno != EINTR){
+        otp_log(OTP_LOG_ERROR, LOG_ACCEPT_FAILED, errno, 0, NULL);
+      }
+      continue;
     }
 
-    printf("SERVER: Connected to client running at host %d port %d\n", 
-                          ntohs(clientAddress.sin_addr.s_addr),
-                          ntohs(clientAddress.sin_port));
+    otp_log(OTP_LOG_INFO, LOG_CONNECTED, ntohl(clientAddress.sin_addr.s_addr),
+            ntohs(clientAddress.sin_port), NULL);
+    struct otp_capture_record capture = { otp_capture_now(), -1, -1 };
     
     // fork so that many clients can connect to the server
     if((childpid = fork()) == 0){
@@ -85,6 +144,7 @@ int main(int argc, char *argv[]){
 
       // initial send from client to get the total size before parsing out
       int total_chars = recv(connectionSocket, &message_size, sizeof(message_size), 0);
+      capture.message_size = message_size;
       message_size = message_size - 1; // to account for handshake -- d
       fflush(stdout);
 
@@ -105,6 +165,9 @@ int main(int argc, char *argv[]){
         if (recv_bites == 0) {
           if (buffer[0] != 'd') {
               fprintf(stderr, "Not from dec client\n");
+              capture.handshake = buffer[0];
+              capture.status = CAPTURE_REJECTED;
+              otp_capture(&capture);
               exit(1);
           }
           // copy the size adjusted buffer (less handshake)
@@ -118,80 +181,51 @@ int main(int argc, char *argv[]){
       }
 
 
+      uint64_t read_done = otp_capture_now();
+      capture.read_us = (read_done - capture.arrival_ns) / 1000;
+
       //decript the message
       char* decripted_message = decript_buffer(response_buffer, message_size-1);
       int message_len = strlen(decripted_message);
+      uint64_t compute_done = otp_capture_now();
+      capture.compute_us = (compute_done - read_done) / 1000;
       // Send a Success message back to the client
       charsRead = send(connectionSocket, 
                       decripted_message, message_len, 0); 
       if (charsRead < 0){
         error("ERROR writing to socket");
       }
+      capture.handshake = 'd';
+      capture.message_len = message_len - 1;
+      capture.write_us = (otp_capture_now() - compute_done) / 1000;
+      capture.status = CAPTURE_SERVED;
+      otp_capture(&capture);
       // Close the connection socket for this client
       free(decripted_message);
       free(response_buffer); 
       close(connectionSocket);
       exit(0);
     } 
+    // the child has its own copy of the connection
+    close(connectionSocket);
   }
 
-  // Close the listening socket
+  // Close the listening socket and wait on the clients still being served
   close(listenSocket); 
+  while (wait(NULL) > 0);
   return 0;
 }
 
 char* decript_buffer(char* buffer, int buffer_len){
-
-   fflush(stdout);
-
-  char possible_characters[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
-  int* message_indexes = calloc(buffer_len, sizeof(int));
-  int i = 0;
-  int j = 0;
-    // search through the first line which is the message we want to encript
-  while (buffer[i] != '\n' && i < buffer_len){
-    // search through alphabet
-    for(j = 0; j < 27; j++){
-      if (buffer[i] == possible_characters[j]){
-        message_indexes[i] = j;
-      }
-    }
-    i++;
-  }
-  
-  int message_len = i;
-
-  fflush(stdout);
-
-  int* keygen_index = calloc(buffer_len, sizeof(int));
-  int key_start = message_len + 1;
-  i++;
-  // search the length of the message through the alphabet
-  // we only need the first x characters 
-  for(int k = 0; k <= message_len; k++){
-    for (j = 0; j < 27; j++){
-      if (buffer[i] == possible_characters[j]){
-        keygen_index[k] = j;
-      }
-    }
-    i++;
+  int message_len = 0;
+  // the first line is the message we want to decript, the key follows it
+  while (buffer[message_len] != '\n' && message_len < buffer_len){
+    message_len++;
   }
 
-  // do the math for the encription
-  // add the key and message index together
-  // if that number is bigger than or equal to 27 then subtract
   char* decript_message = calloc(buffer_len, sizeof(char));
-  for(int h = 0; h < message_len; h++){
-    int decript_index = message_indexes[h] - keygen_index[h];
-    if (decript_index < 0 ){
-      decript_index = decript_index + 27;
-    }
-    decript_message[h] = possible_characters[decript_index];
-  }
-  
-  free(message_indexes);
-  free(keygen_index);
+  decript_range(buffer, buffer + message_len + 1, decript_message, message_len);
   decript_message[message_len] = '\n';
 
   return decript_message;
-}
\ No newline at end of file
+}
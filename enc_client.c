@@ -7,12 +7,14 @@
 #include <netdb.h>      // gethostbyname()
 #include <ctype.h>      // check_key_and_text_len()
 #include <fcntl.h>      // For O_RDONLY
+#include "otp_client.h"  // otp_client_sharded()
 
 // initialize functions
 int check_key_and_text_len();
 char *read_args();
 int recv_full_message();
 int send_full_message();
+int sharded_request();
 
 /**
 * Client code
@@ -57,8 +59,8 @@ int main(int argc, char *argv[]) {
   struct sockaddr_in serverAddress;
   char buffer[256];
   // Check usage & args
-  if (argc < 3) { 
-    fprintf(stderr,"USAGE: %s hostname port\n", argv[0]); 
+  if (argc < 4) { 
+    fprintf(stderr,"USAGE: %s plaintext key port | host:port [host:port ...]\n", argv[0]); 
     exit(0); 
   }
   // assign message and key to variables then check to ensure they are valid
@@ -66,6 +68,11 @@ int main(int argc, char *argv[]) {
   char *keygen = read_args(argv[2]);
   check_key_and_text_len(plaintext, keygen);
 
+  // a list of servers, or a host:port, splits the message across them
+  if (argc > 4 || strchr(argv[3], ':') != NULL) {
+    return sharded_request(argc - 3, argv + 3, plaintext, keygen);
+  }
+
   // if they are valid get the length of the combined message and assign space
   int total_message_length = strlen(plaintext) + strlen(keygen);
   char *plaintext_and_key = malloc(sizeof(char) * (total_message_length + 1));
@@ -168,6 +175,46 @@ char *read_args(char *file_name){
   return string;
 }
 
+// split the message into ranges and send them in parallel to every server
+// given as port or host:port, retrying failed ranges on the others
+int sharded_request(int nendpoints, char *endpoints[], char *plaintext, char *keygen){
+  struct otp_client *client = otp_client_new(4);
+  int *servers = malloc(sizeof(int) * nendpoints);
+
+  for (int i = 0; i < nendpoints; i++){
+    char *hostname = "localhost";
+    char *port = endpoints[i];
+    char *colon = strrchr(endpoints[i], ':');
+    if (colon != NULL){
+      *colon = '\0';
+      hostname = endpoints[i];
+      port = colon + 1;
+    }
+    servers[i] = otp_client_add_server(client, hostname, atoi(port));
+    if (servers[i] < 0){
+      fprintf(stderr, "CLIENT: ERROR, no such host\n"); 
+      exit(0); 
+    }
+  }
+
+  // leave the newline off the ranges and put it back on the answer
+  int message_len = strlen(plaintext) - 1;
+  char *response_buffer = malloc(message_len + 2);
+  if (otp_client_sharded(client, servers, nendpoints, OTP_ENCRYPT, plaintext, keygen,
+                         message_len, 0, response_buffer) < 0){
+    fprintf(stderr, "CLIENT: ERROR, could not reach a server for every range\n");
+    exit(2);
+  }
+  response_buffer[message_len] = '\n';
+  response_buffer[message_len + 1] = '\0';
+
+  printf("%s", response_buffer);
+  free(response_buffer);
+  free(servers);
+  otp_client_free(client);
+  return 0;
+}
+
 /*
 send_full_message and recv_full_message are adopted from
  Beej's Guide to Network Programming: Using Internet Sockets
@@ -0,0 +1,115 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "otp_capture.h"
+
+// records a thread collects before writing them out in one go
+#define CAPTURE_BATCH 128
+
+struct capture_buffer {
+  struct otp_capture_record records[CAPTURE_BATCH];
+  int count;
+  struct capture_buffer *next;
+};
+
+static int captureFD = -1;
+static pid_t capture_pid;
+
+// every thread's buffer, so the last records can be written at exit
+static struct capture_buffer *buffers = NULL;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct capture_buffer *my_buffer = NULL;
+
+int otp_capture_enabled(void){
+  return captureFD >= 0;
+}
+
+uint64_t otp_capture_now(void){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// O_APPEND keeps whole batches from different threads and processes
+// from landing on top of each other
+static void write_records(const struct otp_capture_record *records, int count){
+  if (write(captureFD, records, sizeof(*records) * count) < 0){
+    perror("SERVER: ERROR writing capture");
+  }
+}
+
+static void flush_buffer(struct capture_buffer *buffer){
+  if (buffer->count > 0){
+    write_records(buffer->records, buffer->count);
+    buffer->count = 0;
+  }
+}
+
+void otp_capture(const struct otp_capture_record *record){
+  if (captureFD < 0){
+    return;
+  }
+  // a forked child exits right after, nothing to batch with
+  if (getpid() != capture_pid){
+    write_records(record, 1);
+    return;
+  }
+
+  if (my_buffer == NULL){
+    my_buffer = calloc(1, sizeof(struct capture_buffer));
+    pthread_mutex_lock(&buffers_lock);
+    my_buffer->next = buffers;
+    buffers = my_buffer;
+    pthread_mutex_unlock(&buffers_lock);
+  }
+  my_buffer->records[my_buffer->count++] = *record;
+  if (my_buffer->count == CAPTURE_BATCH){
+    flush_buffer(my_buffer);
+  }
+}
+
+void otp_capture_flush_thread(void){
+  if (my_buffer != NULL){
+    flush_buffer(my_buffer);
+  }
+}
+
+void otp_capture_flush(void){
+  if (captureFD < 0 || getpid() != capture_pid){
+    return;
+  }
+  // the owning threads are done serving by the time this runs at exit
+  pthread_mutex_lock(&buffers_lock);
+  for (struct capture_buffer *buffer = buffers; buffer != NULL; buffer = buffer->next){
+    flush_buffer(buffer);
+  }
+  pthread_mutex_unlock(&buffers_lock);
+}
+
+void otp_capture_start(void){
+  char *path = getenv("OTP_CAPTURE");
+  if (path == NULL){
+    return;
+  }
+  captureFD = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (captureFD < 0){
+    perror("SERVER: ERROR opening capture file");
+    exit(1);
+  }
+
+  // a new file gets the magic, an old one is appended to
+  struct stat info;
+  if (fstat(captureFD, &info) == 0 && info.st_size == 0){
+    if (write(captureFD, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) < 0){
+      perror("SERVER: ERROR writing capture");
+    }
+  }
+  capture_pid = getpid();
+  atexit(otp_capture_flush);
+}
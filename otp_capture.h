@@ -0,0 +1,50 @@
+#ifndef OTP_CAPTURE_H
+#define OTP_CAPTURE_H
+
+#include <stdint.h>
+
+/**
+* Traffic capture
+* With OTP_CAPTURE set to a file name, the servers append one fixed-size
+* record per request to that file: when it arrived, what the client
+* declared and how long each phase took. No message or key is ever
+* written; the replay tool makes up content of the same length.
+*
+* The file starts with CAPTURE_MAGIC and is followed by records in
+* native byte order, batched per thread, so they are not sorted by time.
+*/
+
+#define CAPTURE_MAGIC "OTPCAP1"
+
+enum capture_status { CAPTURE_SERVED, CAPTURE_REJECTED, CAPTURE_DROPPED };
+
+struct otp_capture_record {
+  uint64_t arrival_ns;   // CLOCK_MONOTONIC when the connection was accepted
+  int32_t message_size;  // byte count the client sent first
+  int32_t message_len;   // characters in the message line, -1 if never read
+  uint32_t read_us;      // accept until the whole job was in
+  uint32_t compute_us;   // job in until the result was ready
+  uint32_t write_us;     // result ready until it was sent
+  char handshake;
+  char status;
+  char pad[2];
+};
+
+// open the file named by OTP_CAPTURE, if any
+void otp_capture_start(void);
+
+int otp_capture_enabled(void);
+
+// CLOCK_MONOTONIC in nanoseconds, for filling in records
+uint64_t otp_capture_now(void);
+
+// queue a record in this thread's buffer; a forked child writes it directly
+void otp_capture(const struct otp_capture_record *record);
+
+// write out this thread's buffered records, before it blocks for a while
+void otp_capture_flush_thread(void);
+
+// write out every thread's buffered records
+void otp_capture_flush(void);
+
+#endif
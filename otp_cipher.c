@@ -0,0 +1,64 @@
+#include <string.h>
+#include "otp_server.h"
+
+/**
+* Cipher steps
+* Both directions work on the same 27 character alphabet, encription adds
+* the key to the message and decription takes it back off, mod 27.
+*/
+
+static const char possible_characters[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+const struct otp_service enc_service = { 'e', "enc", encript_range };
+const struct otp_service dec_service = { 'd', "dec", decript_range };
+
+int otp_message_len(const char *buffer, int size){
+  const char *message = buffer + 1;
+  int body_len = size - 1;
+  const char *newline = memchr(message, '\n', body_len - 1);
+  int message_len = newline ? newline - message : body_len - 1;
+  // the key needs a character for every one of the message's, then its newline
+  if (2 * message_len + 2 > body_len){
+    return -1;
+  }
+  return message_len;
+}
+
+// position of c in the alphabet, anything not in it counts as 'A'
+static int char_index(char c){
+  if (c == ' '){
+    return 26;
+  }
+  if (c >= 'A' && c <= 'Z'){
+    return c - 'A';
+  }
+  return 0;
+}
+
+// encript len characters of message with the matching characters of key
+void encript_range(const char* message, const char* key, char* out, int len){
+  // do the math for the encription
+  // add the key and message index together
+  // if that number is bigger than or equal to 27 then subtract
+  for(int h = 0; h < len; h++){
+    int encript_index = char_index(key[h]) + char_index(message[h]);
+    if (encript_index >= 27){
+      encript_index = encript_index - 27;
+    }
+    out[h] = possible_characters[encript_index];
+  }
+}
+
+// decript len characters of message with the matching characters of key
+void decript_range(const char* message, const char* key, char* out, int len){
+  // do the math for the decription
+  // subtract the key from the message index
+  // if that number is below zero then add 27 back
+  for(int h = 0; h < len; h++){
+    int decript_index = char_index(message[h]) - char_index(key[h]);
+    if (decript_index < 0 ){
+      decript_index = decript_index + 27;
+    }
+    out[h] = possible_characters[decript_index];
+  }
+}
@@ -0,0 +1,500 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netdb.h>      // gethostbyname()
+#include "otp_client.h"
+
+#define MAX_EVENTS 64
+
+enum job_state { JOB_QUEUED, JOB_CONNECTING, JOB_SENDING, JOB_RECEIVING };
+
+struct otp_job {
+  struct otp_client *client;
+  int server;
+  int fd;
+  enum job_state state;
+  char *request;        // size header, handshake, message line, key line
+  int request_len;
+  int sent;
+  char *response;       // result line including its newline
+  int response_len;
+  int received;
+  int status;
+  int64_t deadline;     // CLOCK_MONOTONIC ms to give up at, 0 for never
+  otp_callback callback;
+  void *arg;
+  struct otp_job *next;         // server queue or failed list
+  struct otp_job *all_prev;     // every outstanding job, for otp_client_free
+  struct otp_job *all_next;
+};
+
+struct otp_endpoint {
+  struct sockaddr_in address;
+  int active;
+  struct otp_job *queue_head;
+  struct otp_job *queue_tail;
+};
+
+struct otp_client {
+  int max_connections;
+  int timeout_ms;
+  int epollFD;
+  int wakeFD;           // signalled when jobs fail before reaching epoll
+  struct otp_endpoint *servers;
+  int nservers;
+  int outstanding;
+  struct otp_job *all;
+  struct otp_job *failed;
+};
+
+static char wake_marker;
+
+static void start_queued(struct otp_client *client, int server);
+
+struct otp_client *otp_client_new(int max_connections){
+  if (max_connections < 1){
+    return NULL;
+  }
+  struct otp_client *client = calloc(1, sizeof(struct otp_client));
+  client->max_connections = max_connections;
+  // nothing of ours should leak into a program the caller forks or execs
+  client->epollFD = epoll_create1(EPOLL_CLOEXEC);
+  client->wakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (client->epollFD < 0 || client->wakeFD < 0){
+    otp_client_free(client);
+    return NULL;
+  }
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &wake_marker };
+  epoll_ctl(client->epollFD, EPOLL_CTL_ADD, client->wakeFD, &ev);
+  return client;
+}
+
+int otp_client_add_server(struct otp_client *client, const char *hostname, int port){
+  // Get the DNS entry for this host name
+  struct hostent* hostInfo = gethostbyname(hostname);
+  if (hostInfo == NULL){
+    return -1;
+  }
+
+  struct otp_endpoint *servers = realloc(client->servers,
+                        sizeof(struct otp_endpoint) * (client->nservers + 1));
+  if (servers == NULL){
+    return -1;
+  }
+  client->servers = servers;
+
+  struct otp_endpoint *endpoint = &client->servers[client->nservers];
+  memset(endpoint, '\0', sizeof(*endpoint));
+  endpoint->address.sin_family = AF_INET;
+  endpoint->address.sin_port = htons(port);
+  memcpy((char*) &endpoint->address.sin_addr.s_addr,
+        hostInfo->h_addr_list[0],
+        hostInfo->h_length);
+  return client->nservers++;
+}
+
+void otp_client_set_timeout(struct otp_client *client, int timeout_ms){
+  client->timeout_ms = timeout_ms > 0 ? timeout_ms : 0;
+}
+
+static int64_t now_ms(void){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int otp_client_fd(struct otp_client *client){
+  return client->epollFD;
+}
+
+static void free_job(struct otp_job *job){
+  free(job->request);
+  free(job->response);
+  free(job);
+}
+
+// report a job and let the next queued one for its server have the slot
+static void finish_job(struct otp_job *job){
+  struct otp_client *client = job->client;
+  if (job->fd >= 0){
+    close(job->fd);
+    client->servers[job->server].active--;
+  }
+  client->outstanding--;
+  if (job->all_prev != NULL){
+    job->all_prev->all_next = job->all_next;
+  } else {
+    client->all = job->all_next;
+  }
+  if (job->all_next != NULL){
+    job->all_next->all_prev = job->all_prev;
+  }
+
+  job->callback(job->arg, job->status, job->response,
+                job->status == 0 ? job->response_len - 1 : 0);
+  int server = job->server;
+  free_job(job);
+  start_queued(client, server);
+}
+
+// park a job that failed outside of epoll and wake otp_client_run for it
+static void fail_later(struct otp_job *job, int status){
+  uint64_t one = 1;
+  job->status = status;
+  job->next = job->client->failed;
+  job->client->failed = job;
+  // a failed write means the counter is already huge, so it is readable anyway
+  if (write(job->client->wakeFD, &one, sizeof(one)) < 0){
+    return;
+  }
+}
+
+static void start_job(struct otp_job *job){
+  struct otp_client *client = job->client;
+  struct otp_endpoint *endpoint = &client->servers[job->server];
+
+  job->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (job->fd < 0){
+    fail_later(job, errno);
+    return;
+  }
+  endpoint->active++;
+  if (client->timeout_ms > 0){
+    job->deadline = now_ms() + client->timeout_ms;
+  }
+
+  if (connect(job->fd, (struct sockaddr*)&endpoint->address,
+              sizeof(endpoint->address)) < 0 && errno != EINPROGRESS){
+    fail_later(job, errno);
+    return;
+  }
+
+  // writable once the connection is up
+  job->state = JOB_CONNECTING;
+  struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = job };
+  if (epoll_ctl(client->epollFD, EPOLL_CTL_ADD, job->fd, &ev) < 0){
+    fail_later(job, errno);
+  }
+}
+
+static void start_queued(struct otp_client *client, int server){
+  struct otp_endpoint *endpoint = &client->servers[server];
+  while (endpoint->active < client->max_connections && endpoint->queue_head != NULL){
+    struct otp_job *job = endpoint->queue_head;
+    endpoint->queue_head = job->next;
+    if (endpoint->queue_head == NULL){
+      endpoint->queue_tail = NULL;
+    }
+    job->next = NULL;
+    start_job(job);
+  }
+}
+
+int otp_client_submit(struct otp_client *client, int server, enum otp_op op,
+                      const char *message, const char *key, int len,
+                      otp_callback callback, void *arg){
+  if (server < 0 || server >= client->nservers || len < 0 || callback == NULL){
+    return -1;
+  }
+
+  struct otp_job *job = calloc(1, sizeof(struct otp_job));
+  job->client = client;
+  job->server = server;
+  job->fd = -1;
+  job->state = JOB_QUEUED;
+  job->callback = callback;
+  job->arg = arg;
+
+  // same layout enc_client sends: the byte count, then the handshake,
+  // the message and the key each on their own line
+  int message_size = 1 + (len + 1) + (len + 1);
+  job->request_len = sizeof(message_size) + message_size;
+  job->request = malloc(job->request_len);
+  char *p = job->request;
+  memcpy(p, &message_size, sizeof(message_size));
+  p += sizeof(message_size);
+  *p++ = op;
+  memcpy(p, message, len);
+  p += len;
+  *p++ = '\n';
+  memcpy(p, key, len);
+  p += len;
+  *p++ = '\n';
+
+  job->response_len = len + 1;
+  job->response = malloc(job->response_len);
+
+  struct otp_endpoint *endpoint = &client->servers[server];
+  if (endpoint->queue_tail != NULL){
+    endpoint->queue_tail->next = job;
+  } else {
+    endpoint->queue_head = job;
+  }
+  endpoint->queue_tail = job;
+  client->outstanding++;
+  job->all_next = client->all;
+  if (client->all != NULL){
+    client->all->all_prev = job;
+  }
+  client->all = job;
+
+  start_queued(client, server);
+  return 0;
+}
+
+static void fail_job(struct otp_job *job, int status){
+  job->status = status;
+  finish_job(job);
+}
+
+static void handle_event(struct otp_job *job){
+  struct otp_client *client = job->client;
+
+  if (job->state == JOB_CONNECTING){
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    getsockopt(job->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+    if (err != 0){
+      fail_job(job, err);
+      return;
+    }
+    job->state = JOB_SENDING;
+  }
+
+  if (job->state == JOB_SENDING){
+    while (job->sent < job->request_len){
+      int n = send(job->fd, job->request + job->sent,
+                   job->request_len - job->sent, MSG_NOSIGNAL);
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+        return;
+      }
+      if (n < 0){
+        fail_job(job, errno);
+        return;
+      }
+      job->sent += n;
+    }
+    // all sent, wait for the answer
+    job->state = JOB_RECEIVING;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = job };
+    epoll_ctl(client->epollFD, EPOLL_CTL_MOD, job->fd, &ev);
+    return;
+  }
+
+  while (job->received < job->response_len){
+    int n = recv(job->fd, job->response + job->received,
+                 job->response_len - job->received, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+      return;
+    }
+    if (n <= 0){
+      // server hung up before the whole answer arrived
+      fail_job(job, n == 0 ? ECONNRESET : errno);
+      return;
+    }
+    job->received += n;
+  }
+  job->status = 0;
+  finish_job(job);
+}
+
+// jobs on a connection, not yet finished or failed, that have a deadline
+static int can_expire(struct otp_job *job){
+  return job->deadline != 0 && job->state != JOB_QUEUED && job->status == 0;
+}
+
+// fail every job past its deadline; the close drops the stuck connection
+static void expire_jobs(struct otp_client *client){
+  int64_t now = now_ms();
+  // collect first, the callbacks may submit and finish other jobs
+  struct otp_job *expired = NULL;
+  for (struct otp_job *job = client->all; job != NULL; job = job->all_next){
+    if (can_expire(job) && job->deadline <= now){
+      job->next = expired;
+      expired = job;
+    }
+  }
+  while (expired != NULL){
+    struct otp_job *next = expired->next;
+    fail_job(expired, ETIMEDOUT);
+    expired = next;
+  }
+}
+
+int otp_client_run(struct otp_client *client, int timeout_ms){
+  struct epoll_event events[MAX_EVENTS];
+
+  if (client->outstanding == 0){
+    return 0;
+  }
+
+  // never sleep past the first deadline
+  if (client->timeout_ms > 0){
+    int64_t now = now_ms();
+    for (struct otp_job *job = client->all; job != NULL; job = job->all_next){
+      if (can_expire(job)){
+        int64_t left = job->deadline > now ? job->deadline - now : 0;
+        if (timeout_ms < 0 || left < timeout_ms){
+          timeout_ms = left;
+        }
+      }
+    }
+  }
+
+  // a failed wait just looks like a timeout; the caller sees the jobs still out
+  int n = epoll_wait(client->epollFD, events, MAX_EVENTS, timeout_ms);
+  for (int i = 0; i < n; i++){
+    if (events[i].data.ptr == &wake_marker){
+      uint64_t count;
+      // the failed list is drained whether or not the read worked
+      if (read(client->wakeFD, &count, sizeof(count)) < 0){
+        count = 0;
+      }
+      // callbacks may fail more jobs, so take the list before firing any
+      struct otp_job *job = client->failed;
+      client->failed = NULL;
+      while (job != NULL){
+        struct otp_job *next = job->next;
+        finish_job(job);
+        job = next;
+      }
+    } else {
+      handle_event(events[i].data.ptr);
+    }
+  }
+  if (client->timeout_ms > 0){
+    expire_jobs(client);
+  }
+  return client->outstanding;
+}
+
+void otp_client_free(struct otp_client *client){
+  if (client == NULL){
+    return;
+  }
+  struct otp_job *job = client->all;
+  while (job != NULL){
+    struct otp_job *next = job->all_next;
+    if (job->fd >= 0){
+      close(job->fd);
+    }
+    free_job(job);
+    job = next;
+  }
+  free(client->servers);
+  if (client->wakeFD >= 0){
+    close(client->wakeFD);
+  }
+  if (client->epollFD >= 0){
+    close(client->epollFD);
+  }
+  free(client);
+}
+
+// one range of a sharded job
+struct shard {
+  struct shard_run *run;
+  int offset;
+  int len;
+  int first;            // index into the server list it was sent to first
+  int tries;
+};
+
+struct shard_run {
+  struct otp_client *client;
+  const int *servers;
+  int nservers;
+  enum otp_op op;
+  const char *message;
+  const char *key;
+  char *out;
+  int remaining;
+  int failed;
+};
+
+static void shard_done(void *arg, int status, const char *result, int len);
+
+// send the shard to the next server that takes it, giving up once every
+// one has failed it
+static void shard_submit(struct shard *shard){
+  struct shard_run *run = shard->run;
+
+  for (; shard->tries < run->nservers; shard->tries++){
+    int server = run->servers[(shard->first + shard->tries) % run->nservers];
+    if (otp_client_submit(run->client, server, run->op,
+                          run->message + shard->offset, run->key + shard->offset,
+                          shard->len, shard_done, shard) == 0){
+      return;
+    }
+  }
+  run->failed = 1;
+  run->remaining--;
+}
+
+static void shard_done(void *arg, int status, const char *result, int len){
+  struct shard *shard = arg;
+  struct shard_run *run = shard->run;
+
+  if (status == 0){
+    memcpy(run->out + shard->offset, result, len);
+    run->remaining--;
+    return;
+  }
+
+  // move on to the next server
+  shard->tries++;
+  shard_submit(shard);
+}
+
+int otp_client_sharded(struct otp_client *client, const int *servers, int nservers,
+                       enum otp_op op, const char *message, const char *key,
+                       int len, int shard_size, char *out){
+  if (nservers < 1 || len < 0){
+    return -1;
+  }
+  // a few shards per server by default so faster servers pick up the slack
+  if (shard_size <= 0){
+    shard_size = (len + nservers * 4 - 1) / (nservers * 4);
+    if (shard_size < 4096){
+      shard_size = 4096;
+    }
+  }
+
+  int nshards = (len + shard_size - 1) / shard_size;
+  if (nshards == 0){
+    return 0;
+  }
+  struct shard_run run = { client, servers, nservers, op, message, key, out, nshards, 0 };
+  struct shard *shards = calloc(nshards, sizeof(struct shard));
+
+  // a server that takes the connection and never answers must not hold
+  // up the whole run, so shards always get a deadline
+  int timeout_ms = client->timeout_ms;
+  if (timeout_ms == 0){
+    otp_client_set_timeout(client, SHARD_TIMEOUT_MS);
+  }
+
+  for (int i = 0; i < nshards; i++){
+    shards[i].run = &run;
+    shards[i].offset = i * shard_size;
+    shards[i].len = len - shards[i].offset < shard_size ? len - shards[i].offset : shard_size;
+    shards[i].first = i % nservers;
+    shard_submit(&shards[i]);
+  }
+  while (run.remaining > 0){
+    otp_client_run(client, -1);
+  }
+
+  otp_client_set_timeout(client, timeout_ms);
+  free(shards);
+  return run.failed ? -1 : 0;
+}
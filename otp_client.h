@@ -0,0 +1,69 @@
+#ifndef OTP_CLIENT_H
+#define OTP_CLIENT_H
+
+/**
+* Client library
+* Talks to enc_server and dec_server from inside another program without
+* blocking it. Jobs are submitted against a server added with
+* otp_client_add_server and finish through a callback fired from
+* otp_client_run. Everything runs on the calling thread, so a
+* single thread can keep thousands of jobs outstanding.
+*
+* The servers answer one job per connection, so the pool keeps at most
+* max_connections sockets open to each server and queues the rest until
+* a slot frees up.
+*/
+
+enum otp_op { OTP_ENCRYPT = 'e', OTP_DECRYPT = 'd' };
+
+// status is 0 on success or an errno value; result holds len characters
+// with no newline and is only valid until the callback returns
+typedef void (*otp_callback)(void *arg, int status, const char *result, int len);
+
+struct otp_client;
+
+// make a client allowing max_connections open sockets per server
+struct otp_client *otp_client_new(int max_connections);
+
+// fail a job with ETIMEDOUT once it has spent timeout_ms on its
+// connection without an answer, closing the connection. Time spent
+// queued for a free connection does not count. 0, the default, waits
+// as long as it takes.
+void otp_client_set_timeout(struct otp_client *client, int timeout_ms);
+
+// resolve a server once and return its index for otp_client_submit, or -1
+int otp_client_add_server(struct otp_client *client, const char *hostname, int port);
+
+// queue len characters of message to be run through the server with key,
+// which must be at least len characters long. The message and key are
+// copied, so they can be freed as soon as this returns. Returns 0, or -1
+// if the server index or arguments are bad.
+int otp_client_submit(struct otp_client *client, int server, enum otp_op op,
+                      const char *message, const char *key, int len,
+                      otp_callback callback, void *arg);
+
+// how long a shard may wait for an answer when the client has no timeout
+#define SHARD_TIMEOUT_MS 5000
+
+// run len characters through a list of servers, cut into ranges of
+// shard_size (0 picks one) that are sent in parallel and written back into
+// out in order. A range that fails, or gets no answer within the client's
+// timeout (SHARD_TIMEOUT_MS if none is set), is retried on the next server
+// in the list. Blocks until done; returns 0, or -1 if a range failed
+// everywhere.
+int otp_client_sharded(struct otp_client *client, const int *servers, int nservers,
+                       enum otp_op op, const char *message, const char *key,
+                       int len, int shard_size, char *out);
+
+// descriptor that turns readable whenever otp_client_run has work to do,
+// for callers who want to wait on it inside their own poll loop
+int otp_client_fd(struct otp_client *client);
+
+// do whatever I/O is ready, waiting up to timeout_ms (-1 blocks) for some,
+// and fire callbacks for finished jobs. Returns the jobs still outstanding.
+int otp_client_run(struct otp_client *client, int timeout_ms);
+
+// close every connection and drop outstanding jobs without calling back
+void otp_client_free(struct otp_client *client);
+
+#endif
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "otp_server.h"
+#include "otp_log.h"
+#include "otp_capture.h"
+
+/**
+* OTP daemon
+* Serves enc and dec clients from one process, so both operations share
+* one set of I/O threads, one compute pool and one set of job buffers
+* instead of splitting the machine between two servers. Each port only
+* takes its own clients, like the separate servers; given the same port
+* twice, one socket takes both and goes by the handshake byte.
+*/
+
+static const struct otp_service *const services[] = { &enc_service, &dec_service };
+
+// Error function used for reporting issues
+void error(const char *msg) {
+  perror(msg);
+  exit(1);
+}
+
+// create a socket listening on port
+static int listen_on(int portNumber){
+  struct sockaddr_in serverAddress;
+
+  int listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+  if (listenSocket < 0) {
+    error("ERROR opening socket");
+  }
+
+  memset((char*) &serverAddress, '\0', sizeof(serverAddress));
+  serverAddress.sin_family = AF_INET;
+  serverAddress.sin_port = htons(portNumber);
+  serverAddress.sin_addr.s_addr = INADDR_ANY;
+
+  if (bind(listenSocket,
+          (struct sockaddr *)&serverAddress,
+          sizeof(serverAddress)) < 0){
+    error("ERROR on binding");
+  }
+  listen(listenSocket, SOMAXCONN);
+  return listenSocket;
+}
+
+int main(int argc, char *argv[]){
+  // Check usage & args
+  if (argc < 3) {
+    fprintf(stderr,"USAGE: %s enc_port dec_port [io_threads [compute_threads]]\n", argv[0]);
+    exit(1);
+  }
+
+  int enc_port = atoi(argv[1]);
+  int dec_port = atoi(argv[2]);
+  int io_threads = argc > 3 ? atoi(argv[3]) : 2;
+  int compute_threads = argc > 4 ? atoi(argv[4]) : sysconf(_SC_NPROCESSORS_ONLN);
+
+  otp_log_start();
+
+  // SIGUSR2 hands both ports to a freshly started copy of this binary;
+  // catch it now so one that comes in during startup does not kill us
+  catch_upgrade_signal();
+
+  otp_capture_start();
+
+  struct otp_listener listeners[2];
+  int nlisteners = enc_port == dec_port ? 1 : 2;
+  int sockets[2];
+
+  // a daemon being replaced passes its sockets down in the same order
+  if (inherited_listen_sockets(sockets, 2) != nlisteners) {
+    sockets[0] = listen_on(enc_port);
+    if (nlisteners == 2) {
+      sockets[1] = listen_on(dec_port);
+    }
+  }
+
+  if (nlisteners == 1) {
+    listeners[0] = (struct otp_listener){ sockets[0], NULL };
+  } else {
+    listeners[0] = (struct otp_listener){ sockets[0], &enc_service };
+    listeners[1] = (struct otp_listener){ sockets[1], &dec_service };
+  }
+
+  if (run_pool_server(listeners, nlisteners, services, 2,
+                      io_threads, compute_threads, argv) < 0){
+    exit(1);
+  }
+  return 0;
+}
@@ -0,0 +1,280 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "otp_log.h"
+
+// records per thread ring, a power of two so indexes can be masked
+#define RING_SIZE 1024
+#define BATCH_SIZE (64 * 1024)
+// how often the writer drains the rings
+#define FLUSH_INTERVAL_NS (10 * 1000 * 1000)
+
+struct log_record {
+  struct timespec time;
+  short level;
+  short event;
+  int thread;
+  long arg[2];
+  const char *name;
+};
+
+// single producer, single consumer: only the owning thread moves tail,
+// only the writer moves head
+struct log_ring {
+  struct log_record records[RING_SIZE];
+  atomic_uint head;
+  atomic_uint tail;
+  atomic_long dropped;
+  atomic_long limited;
+  int thread;
+  time_t window;         // second the rate limit is counting for
+  int in_window;
+  struct log_ring *next;
+};
+
+// how each event prints: its name and the keys for its arguments
+static const struct {
+  const char *name;
+  const char *key[2];
+  const char *name_key;
+} events[LOG_EVENT_COUNT] = {
+  [LOG_CONNECTED]      = { "connected", { "host", "port" }, NULL },
+  [LOG_BAD_HANDSHAKE]  = { "bad_handshake", { NULL, NULL }, "expected" },
+  [LOG_BAD_SIZE]       = { "bad_size", { "size", NULL }, NULL },
+  [LOG_SHORT_KEY]      = { "short_key", { "size", NULL }, NULL },
+  [LOG_ACCEPT_FAILED]  = { "accept_failed", { "error", NULL }, NULL },
+  [LOG_WATCH_FAILED]   = { "watch_failed", { "error", NULL }, NULL },
+  [LOG_WAIT_FAILED]    = { "wait_failed", { "error", NULL }, NULL },
+  [LOG_WAKE_FAILED]    = { "wake_failed", { "error", NULL }, NULL },
+  [LOG_SEND_FAILED]    = { "send_failed", { "error", NULL }, NULL },
+  [LOG_HANDED_OFF]     = { "handed_off", { NULL, NULL }, NULL },
+  [LOG_UPGRADE_FAILED] = { "upgrade_failed", { NULL, NULL }, NULL },
+  [LOG_DROPPED]        = { "dropped", { "full", "rate_limited" }, NULL },
+};
+
+static const char *level_names[] = { "debug", "info", "warn", "error" };
+
+static atomic_int min_level = OTP_LOG_INFO;
+static int rate_limit = 0;     // records per second per thread, 0 for none
+static pid_t log_pid;
+
+// every ring ever made, pushed on with compare and swap
+static _Atomic(struct log_ring *) rings = NULL;
+static atomic_int next_thread = 0;
+static __thread struct log_ring *my_ring = NULL;
+
+// held by whoever is draining, never by the threads logging
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct log_ring *new_ring(void){
+  struct log_ring *ring = calloc(1, sizeof(struct log_ring));
+  ring->thread = atomic_fetch_add(&next_thread, 1);
+  ring->next = atomic_load(&rings);
+  while (!atomic_compare_exchange_weak(&rings, &ring->next, ring));
+  return ring;
+}
+
+int otp_log_enabled(enum otp_log_level level){
+  return (int)level >= atomic_load_explicit(&min_level, memory_order_relaxed);
+}
+
+void otp_log(enum otp_log_level level, enum otp_log_event event,
+             long a, long b, const char *name){
+  if (!otp_log_enabled(level)){
+    return;
+  }
+  if (my_ring == NULL){
+    my_ring = new_ring();
+  }
+  struct log_ring *ring = my_ring;
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (rate_limit > 0){
+    if (now.tv_sec != ring->window){
+      ring->window = now.tv_sec;
+      ring->in_window = 0;
+    }
+    if (ring->in_window >= rate_limit){
+      atomic_fetch_add_explicit(&ring->limited, 1, memory_order_relaxed);
+      return;
+    }
+    ring->in_window++;
+  }
+
+  unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (tail - head == RING_SIZE){
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  struct log_record *record = &ring->records[tail & (RING_SIZE - 1)];
+  record->time = now;
+  record->level = level;
+  record->event = event;
+  record->thread = ring->thread;
+  record->arg[0] = a;
+  record->arg[1] = b;
+  record->name = name;
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+// one batch per stream, written out whenever it fills
+struct batch {
+  int fd;
+  char data[BATCH_SIZE];
+  int len;
+};
+
+static void flush_batch(struct batch *batch){
+  int done = 0;
+  while (done < batch->len){
+    int n = write(batch->fd, batch->data + done, batch->len - done);
+    if (n <= 0){
+      break;
+    }
+    done += n;
+  }
+  batch->len = 0;
+}
+
+// add to a line, never running past its end
+static void append(char *line, int *len, int size, const char *fmt, ...){
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(line + *len, size - *len, fmt, args);
+  va_end(args);
+  *len += n;
+  if (*len > size - 1){
+    *len = size - 1;
+  }
+}
+
+static void format_record(struct batch *batch, const struct log_record *record){
+  char line[256];
+  char error[128];
+  int len = 0;
+
+  append(line, &len, sizeof(line) - 1, "ts=%ld.%06ld level=%s thread=%d event=%s",
+         (long)record->time.tv_sec, record->time.tv_nsec / 1000,
+         level_names[record->level], record->thread,
+         events[record->event].name);
+  for (int i = 0; i < 2 && events[record->event].key[i] != NULL; i++){
+    const char *key = events[record->event].key[i];
+    if (strcmp(key, "error") == 0){
+      append(line, &len, sizeof(line) - 1, " error=\"%s\"",
+             strerror_r(record->arg[i], error, sizeof(error)));
+    } else if (strcmp(key, "host") == 0){
+      // an IPv4 address in host byte order
+      unsigned long host = record->arg[i];
+      append(line, &len, sizeof(line) - 1, " host=%lu.%lu.%lu.%lu",
+             (host >> 24) & 0xff, (host >> 16) & 0xff, (host >> 8) & 0xff, host & 0xff);
+    } else {
+      append(line, &len, sizeof(line) - 1, " %s=%ld", key, record->arg[i]);
+    }
+  }
+  if (events[record->event].name_key != NULL && record->name != NULL){
+    append(line, &len, sizeof(line) - 1, " %s=%s",
+           events[record->event].name_key, record->name);
+  }
+  line[len++] = '\n';
+
+  if (batch->len + len > BATCH_SIZE){
+    flush_batch(batch);
+  }
+  memcpy(batch->data + batch->len, line, len);
+  batch->len += len;
+}
+
+// format everything queued in every ring and write it out. Losses are
+// summed up and reported once a second, or right away when final is set
+static void drain_rings(int final){
+  static struct batch out = { STDOUT_FILENO };
+  static struct batch err = { STDERR_FILENO };
+  static long dropped = 0;
+  static long limited = 0;
+  static time_t reported = 0;
+
+  pthread_mutex_lock(&drain_lock);
+  for (struct log_ring *ring = atomic_load(&rings); ring != NULL; ring = ring->next){
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    while (head != tail){
+      struct log_record *record = &ring->records[head & (RING_SIZE - 1)];
+      format_record(record->level >= OTP_LOG_WARN ? &err : &out, record);
+      head++;
+    }
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+    dropped += atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    limited += atomic_exchange_explicit(&ring->limited, 0, memory_order_relaxed);
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if ((dropped > 0 || limited > 0) && (final || now.tv_sec != reported)){
+    struct log_record record = { .level = OTP_LOG_WARN, .event = LOG_DROPPED,
+                                 .thread = -1, .arg = { dropped, limited } };
+    clock_gettime(CLOCK_REALTIME, &record.time);
+    format_record(&err, &record);
+    dropped = 0;
+    limited = 0;
+    reported = now.tv_sec;
+  }
+  flush_batch(&out);
+  flush_batch(&err);
+  pthread_mutex_unlock(&drain_lock);
+}
+
+static void *writer_thread(void *arg){
+  struct timespec interval = { 0, FLUSH_INTERVAL_NS };
+  while (1){
+    nanosleep(&interval, NULL);
+    drain_rings(0);
+  }
+  return NULL;
+}
+
+void otp_log_flush(void){
+  // a forked child shares our rings but not our writer, leave them be
+  if (getpid() != log_pid){
+    return;
+  }
+  drain_rings(1);
+}
+
+void otp_log_start(void){
+  char *level = getenv("OTP_LOG_LEVEL");
+  if (level != NULL){
+    for (int i = 0; i < 4; i++){
+      if (strcmp(level, level_names[i]) == 0){
+        atomic_store(&min_level, i);
+      }
+    }
+  }
+  char *rate = getenv("OTP_LOG_RATE");
+  if (rate != NULL){
+    rate_limit = atoi(rate);
+  }
+
+  log_pid = getpid();
+
+  // signals are for the threads serving, the writer starts with all blocked
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, writer_thread, NULL) != 0){
+    perror("SERVER: ERROR starting log thread");
+    exit(1);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_detach(thread);
+  atexit(otp_log_flush);
+}
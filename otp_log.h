@@ -0,0 +1,48 @@
+#ifndef OTP_LOG_H
+#define OTP_LOG_H
+
+/**
+* Server logging
+* otp_log never blocks: it copies a fixed-size record into a lock-free
+* ring owned by the calling thread and returns. A background thread
+* drains every ring, formats the records as key=value lines and writes
+* them out in batches, info and below to stdout, warnings and errors to
+* stderr. A full ring or a thread over its rate limit drops records;
+* the writer reports how many were lost.
+*
+* OTP_LOG_LEVEL (debug, info, warn, error) sets the lowest level kept and
+* OTP_LOG_RATE caps the records each thread may log per second.
+*/
+
+enum otp_log_level { OTP_LOG_DEBUG, OTP_LOG_INFO, OTP_LOG_WARN, OTP_LOG_ERROR };
+
+enum otp_log_event {
+  LOG_CONNECTED,         // IPv4 address in host byte order, port
+  LOG_BAD_HANDSHAKE,     // name of the service expected
+  LOG_BAD_SIZE,          // declared message size
+  LOG_SHORT_KEY,         // declared message size
+  LOG_ACCEPT_FAILED,     // errno
+  LOG_WATCH_FAILED,      // errno
+  LOG_WAIT_FAILED,       // errno
+  LOG_WAKE_FAILED,       // errno
+  LOG_SEND_FAILED,       // errno
+  LOG_HANDED_OFF,
+  LOG_UPGRADE_FAILED,
+  LOG_DROPPED,           // records lost to full rings, records rate limited
+  LOG_EVENT_COUNT
+};
+
+// read the settings from the environment and start the writer thread
+void otp_log_start(void);
+
+// whether records at level are kept, to skip work done only for a record
+int otp_log_enabled(enum otp_log_level level);
+
+// queue one record; name must be a string that outlives the process
+void otp_log(enum otp_log_level level, enum otp_log_event event,
+             long a, long b, const char *name);
+
+// write out everything queued so far, for use before exiting
+void otp_log_flush(void);
+
+#endif
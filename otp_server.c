@@ -0,0 +1,791 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include "otp_server.h"
+#include "otp_log.h"
+#include "otp_capture.h"
+
+/**
+* Pool server
+* I/O threads accept connections and read whole jobs off the sockets
+* without ever blocking. A finished read is cut into chunks and handed
+* to the compute pool, where every thread owns a deque and steals from
+* the others once its own runs dry. The last chunk of a job to finish
+* hands the job back to the I/O thread that owns the socket for sending.
+*
+* One pool can sit behind several listening sockets and services, so a
+* daemon serving both enc and dec puts all its threads and its job
+* buffers behind whichever operation is busy.
+*/
+
+// messages longer than this are split so one big job can use every core
+#define CHUNK_SIZE (64 * 1024)
+#define MAX_EVENTS 64
+// job buffers are kept for reuse in power of two classes from 4KB to 1MB,
+// up to BUFFER_CLASS_BYTES of free buffers per class
+#define BUFFER_MIN_SHIFT 12
+#define BUFFER_CLASSES 9
+#define BUFFER_CLASS_BYTES (8 * 1024 * 1024)
+
+enum job_state { JOB_READ_SIZE, JOB_READ_BODY, JOB_COMPUTE, JOB_WRITE };
+
+struct job;
+struct io_thread;
+
+// one range of a job for a compute thread
+struct task {
+  struct job *job;
+  int offset;
+  int len;
+};
+
+struct job {
+  int fd;
+  enum job_state state;
+  const struct otp_service *service;  // NULL until the handshake picks one
+  int message_size;      // total sent by the client, handshake included
+  int size_read;         // how much of message_size has arrived
+  char *buffer;
+  int recv_bites;
+  int message_len;
+  char *result;
+  int result_len;
+  int sent;
+  atomic_int chunks_left;
+  struct task *tasks;
+  struct io_thread *owner;
+  struct job *next;
+  uint64_t accepted;     // phase times for the capture, in nanoseconds
+  uint64_t read_done;
+  uint64_t compute_done;
+  int status;            // how the job ended, one of enum capture_status
+};
+
+// mutex guarded deque: the owner pushes and pops at the back,
+// thieves take the oldest task from the front
+struct deque {
+  pthread_mutex_t lock;
+  struct task **items;
+  int head;
+  int count;
+  int capacity;
+};
+
+struct compute_pool {
+  const struct otp_service *const *services;  // what routed listeners serve
+  int nservices;
+  int nworkers;
+  struct deque *deques;
+  atomic_int queued;
+  atomic_uint next_deque;
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_cond;
+};
+
+struct worker {
+  pthread_t thread;
+  struct compute_pool *pool;
+  int index;
+};
+
+struct io_thread {
+  pthread_t thread;
+  int epollFD;
+  int wakeFD;            // eventfd poked by compute threads when a job is done
+  const struct otp_listener *listeners;
+  int nlisteners;
+  struct compute_pool *pool;
+  pthread_mutex_t done_lock;
+  struct job *done;
+  int jobs;              // connections this thread still has open
+  atomic_int draining;   // set once the listener has been handed off
+};
+
+// free buffers of one size class, linked through their first bytes
+struct buffer_class {
+  pthread_mutex_t lock;
+  void *free;
+  int count;
+};
+
+// marker so epoll events can tell the wakeup fd from listeners and jobs
+static char wake_marker;
+
+// shared by every I/O thread, whichever service the buffer was used for
+static struct buffer_class buffer_classes[BUFFER_CLASSES];
+
+// the class a buffer of size bytes comes from, or -1 if too big to keep
+static int buffer_class(int size){
+  for (int c = 0; c < BUFFER_CLASSES; c++){
+    if (size <= 1 << (BUFFER_MIN_SHIFT + c)){
+      return c;
+    }
+  }
+  return -1;
+}
+
+static char *buffer_get(int size){
+  int c = buffer_class(size);
+  if (c < 0){
+    return malloc(size);
+  }
+  struct buffer_class *bc = &buffer_classes[c];
+  pthread_mutex_lock(&bc->lock);
+  void *buffer = bc->free;
+  if (buffer != NULL){
+    bc->free = *(void**)buffer;
+    bc->count--;
+  }
+  pthread_mutex_unlock(&bc->lock);
+  if (buffer == NULL){
+    buffer = malloc(1 << (BUFFER_MIN_SHIFT + c));
+  }
+  return buffer;
+}
+
+// size must be what the buffer was asked for with
+static void buffer_put(char *buffer, int size){
+  if (buffer == NULL){
+    return;
+  }
+  int c = buffer_class(size);
+  if (c < 0){
+    free(buffer);
+    return;
+  }
+  struct buffer_class *bc = &buffer_classes[c];
+  pthread_mutex_lock(&bc->lock);
+  if (bc->count < BUFFER_CLASS_BYTES >> (BUFFER_MIN_SHIFT + c)){
+    *(void**)buffer = bc->free;
+    bc->free = buffer;
+    bc->count++;
+    buffer = NULL;
+  }
+  pthread_mutex_unlock(&bc->lock);
+  free(buffer);
+}
+
+static void deque_init(struct deque *d){
+  pthread_mutex_init(&d->lock, NULL);
+  d->capacity = 64;
+  d->items = malloc(sizeof(struct task*) * d->capacity);
+  d->head = 0;
+  d->count = 0;
+}
+
+static void deque_push_back(struct deque *d, struct task *t){
+  pthread_mutex_lock(&d->lock);
+  if (d->count == d->capacity){
+    // grow and unwrap the ring so head starts at zero again
+    struct task **items = malloc(sizeof(struct task*) * d->capacity * 2);
+    for (int i = 0; i < d->count; i++){
+      items[i] = d->items[(d->head + i) % d->capacity];
+    }
+    free(d->items);
+    d->items = items;
+    d->head = 0;
+    d->capacity *= 2;
+  }
+  d->items[(d->head + d->count) % d->capacity] = t;
+  d->count++;
+  pthread_mutex_unlock(&d->lock);
+}
+
+static struct task *deque_pop_back(struct deque *d){
+  struct task *t = NULL;
+  pthread_mutex_lock(&d->lock);
+  if (d->count > 0){
+    d->count--;
+    t = d->items[(d->head + d->count) % d->capacity];
+  }
+  pthread_mutex_unlock(&d->lock);
+  return t;
+}
+
+static struct task *deque_steal_front(struct deque *d){
+  struct task *t = NULL;
+  pthread_mutex_lock(&d->lock);
+  if (d->count > 0){
+    t = d->items[d->head];
+    d->head = (d->head + 1) % d->capacity;
+    d->count--;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return t;
+}
+
+// put every chunk of a job on one deque; idle threads will steal them
+static void submit_job(struct compute_pool *pool, struct job *job, int ntasks){
+  int d = atomic_fetch_add(&pool->next_deque, 1) % pool->nworkers;
+  for (int i = 0; i < ntasks; i++){
+    deque_push_back(&pool->deques[d], &job->tasks[i]);
+  }
+  atomic_fetch_add(&pool->queued, ntasks);
+
+  pthread_mutex_lock(&pool->idle_lock);
+  if (ntasks > 1){
+    pthread_cond_broadcast(&pool->idle_cond);
+  } else {
+    pthread_cond_signal(&pool->idle_cond);
+  }
+  pthread_mutex_unlock(&pool->idle_lock);
+}
+
+// hand a finished job back to the I/O thread that owns its socket
+static void finish_job(struct job *job){
+  struct io_thread *io = job->owner;
+  uint64_t one = 1;
+
+  job->compute_done = otp_capture_now();
+  pthread_mutex_lock(&io->done_lock);
+  job->next = io->done;
+  io->done = job;
+  pthread_mutex_unlock(&io->done_lock);
+
+  if (write(io->wakeFD, &one, sizeof(one)) < 0){
+    otp_log(OTP_LOG_ERROR, LOG_WAKE_FAILED, errno, 0, NULL);
+  }
+}
+
+static void *compute_thread(void *arg){
+  struct worker *self = arg;
+  struct compute_pool *pool = self->pool;
+
+  while (1){
+    struct task *t = deque_pop_back(&pool->deques[self->index]);
+    // nothing of our own, try to steal from the other threads
+    for (int i = 1; t == NULL && i < pool->nworkers; i++){
+      t = deque_steal_front(&pool->deques[(self->index + i) % pool->nworkers]);
+    }
+    if (t == NULL){
+      pthread_mutex_lock(&pool->idle_lock);
+      while (atomic_load(&pool->queued) == 0){
+        pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+      }
+      pthread_mutex_unlock(&pool->idle_lock);
+      continue;
+    }
+    atomic_fetch_sub(&pool->queued, 1);
+
+    struct job *job = t->job;
+    char *message = job->buffer + 1;
+    char *key = message + job->message_len + 1;
+    job->service->transform(message + t->offset, key + t->offset,
+                            job->result + t->offset, t->len);
+
+    if (atomic_fetch_sub(&job->chunks_left, 1) == 1){
+      finish_job(job);
+    }
+  }
+  return NULL;
+}
+
+static void capture_job(struct job *job){
+  uint64_t closed = otp_capture_now();
+  struct otp_capture_record record = { 0 };
+
+  record.arrival_ns = job->accepted;
+  record.message_size = job->size_read == sizeof(job->message_size) ? job->message_size : -1;
+  record.message_len = job->state >= JOB_COMPUTE ? job->message_len : -1;
+  record.handshake = job->recv_bites > 0 ? job->buffer[0] : 0;
+  record.status = job->status;
+  if (job->read_done){
+    record.read_us = (job->read_done - job->accepted) / 1000;
+  }
+  if (job->compute_done){
+    record.compute_us = (job->compute_done - job->read_done) / 1000;
+    record.write_us = (closed - job->compute_done) / 1000;
+  }
+  otp_capture(&record);
+}
+
+static void close_job(struct job *job){
+  if (otp_capture_enabled()){
+    capture_job(job);
+  }
+  job->owner->jobs--;
+  close(job->fd);
+  buffer_put(job->buffer, job->message_size);
+  buffer_put(job->result, job->result_len);
+  free(job->tasks);
+  free(job);
+}
+
+// the whole message is in, check it and split it up for the compute pool
+static void start_job(struct io_thread *io, struct job *job){
+  struct compute_pool *pool = io->pool;
+
+  // stop watching the socket until there is something to send
+  epoll_ctl(io->epollFD, EPOLL_CTL_DEL, job->fd, NULL);
+  job->read_done = otp_capture_now();
+  job->status = CAPTURE_REJECTED;
+
+  // a listener without a service of its own goes by the handshake
+  if (job->service == NULL){
+    for (int i = 0; i < pool->nservices; i++){
+      if (job->buffer[0] == pool->services[i]->handshake){
+        job->service = pool->services[i];
+      }
+    }
+    if (job->service == NULL){
+      otp_log(OTP_LOG_WARN, LOG_BAD_HANDSHAKE, 0, 0, NULL);
+      close_job(job);
+      return;
+    }
+  }
+  if (job->buffer[0] != job->service->handshake){
+    otp_log(OTP_LOG_WARN, LOG_BAD_HANDSHAKE, 0, 0, job->service->name);
+    close_job(job);
+    return;
+  }
+
+  job->message_len = otp_message_len(job->buffer, job->message_size);
+  if (job->message_len < 0){
+    otp_log(OTP_LOG_WARN, LOG_SHORT_KEY, job->message_size, 0, NULL);
+    close_job(job);
+    return;
+  }
+
+  job->result_len = job->message_len + 1;
+  job->result = buffer_get(job->result_len);
+  job->result[job->message_len] = '\n';
+
+  int ntasks = (job->message_len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  if (ntasks == 0){
+    ntasks = 1;
+  }
+  job->tasks = malloc(sizeof(struct task) * ntasks);
+  for (int i = 0; i < ntasks; i++){
+    job->tasks[i].job = job;
+    job->tasks[i].offset = i * CHUNK_SIZE;
+    job->tasks[i].len = job->message_len - i * CHUNK_SIZE;
+    if (job->tasks[i].len > CHUNK_SIZE){
+      job->tasks[i].len = CHUNK_SIZE;
+    }
+  }
+  atomic_store(&job->chunks_left, ntasks);
+  job->state = JOB_COMPUTE;
+  job->status = CAPTURE_DROPPED;
+  submit_job(pool, job, ntasks);
+}
+
+// read as much of the job as the socket has ready
+static void read_job(struct io_thread *io, struct job *job){
+  while (job->state == JOB_READ_SIZE || job->state == JOB_READ_BODY){
+    int n;
+    if (job->state == JOB_READ_SIZE){
+      n = recv(job->fd, (char*)&job->message_size + job->size_read,
+               sizeof(job->message_size) - job->size_read, 0);
+    } else {
+      n = recv(job->fd, job->buffer + job->recv_bites,
+               job->message_size - job->recv_bites, 0);
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+      return;
+    }
+    if (n <= 0){
+      // client went away or the socket failed before the job was in
+      close_job(job);
+      return;
+    }
+
+    if (job->state == JOB_READ_SIZE){
+      job->size_read += n;
+      if (job->size_read == sizeof(job->message_size)){
+        // need at least the handshake and the message newline
+        if (job->message_size < 2){
+          otp_log(OTP_LOG_WARN, LOG_BAD_SIZE, job->message_size, 0, NULL);
+          job->status = CAPTURE_REJECTED;
+          close_job(job);
+          return;
+        }
+        job->buffer = buffer_get(job->message_size);
+        job->state = JOB_READ_BODY;
+      }
+    } else {
+      job->recv_bites += n;
+      if (job->recv_bites == job->message_size){
+        start_job(io, job);
+        return;
+      }
+    }
+  }
+}
+
+// send as much of the result as the socket will take
+static void write_job(struct io_thread *io, struct job *job){
+  while (job->sent < job->result_len){
+    int n = send(job->fd, job->result + job->sent,
+                 job->result_len - job->sent, MSG_NOSIGNAL);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+      if (job->state != JOB_WRITE){
+        struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = job };
+        job->state = JOB_WRITE;
+        epoll_ctl(io->epollFD, EPOLL_CTL_ADD, job->fd, &ev);
+      }
+      return;
+    }
+    if (n < 0){
+      otp_log(OTP_LOG_ERROR, LOG_SEND_FAILED, errno, 0, NULL);
+      break;
+    }
+    job->sent += n;
+  }
+  if (job->sent == job->result_len){
+    job->status = CAPTURE_SERVED;
+  }
+  close_job(job);
+}
+
+static void accept_jobs(struct io_thread *io, const struct otp_listener *listener){
+  struct sockaddr_in clientAddress;
+  socklen_t sizeOfClientInfo = sizeof(clientAddress);
+
+  while (1){
+    int connectionSocket = accept4(listener->socket,
+                (struct sockaddr *)&clientAddress,
+                &sizeOfClientInfo, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (connectionSocket < 0){
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+        otp_log(OTP_LOG_ERROR, LOG_ACCEPT_FAILED, errno, 0, NULL);
+      }
+      return;
+    }
+
+    otp_log(OTP_LOG_INFO, LOG_CONNECTED, ntohl(clientAddress.sin_addr.s_addr),
+            ntohs(clientAddress.sin_port), NULL);
+
+    struct job *job = calloc(1, sizeof(struct job));
+    job->fd = connectionSocket;
+    job->state = JOB_READ_SIZE;
+    job->service = listener->service;
+    job->owner = io;
+    job->accepted = otp_capture_now();
+    job->status = CAPTURE_DROPPED;
+    io->jobs++;
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = job };
+    if (epoll_ctl(io->epollFD, EPOLL_CTL_ADD, connectionSocket, &ev) < 0){
+      otp_log(OTP_LOG_ERROR, LOG_WATCH_FAILED, errno, 0, NULL);
+      close_job(job);
+    }
+  }
+}
+
+// pick up every job the compute pool has finished and start sending it
+static void drain_done(struct io_thread *io){
+  uint64_t count;
+  if (read(io->wakeFD, &count, sizeof(count)) < 0 && errno != EAGAIN){
+    otp_log(OTP_LOG_ERROR, LOG_WAKE_FAILED, errno, 0, NULL);
+  }
+
+  pthread_mutex_lock(&io->done_lock);
+  struct job *job = io->done;
+  io->done = NULL;
+  pthread_mutex_unlock(&io->done_lock);
+
+  while (job != NULL){
+    struct job *next = job->next;
+    write_job(io, job);
+    job = next;
+  }
+}
+
+static void *io_thread_main(void *arg){
+  struct io_thread *io = arg;
+  struct epoll_event events[MAX_EVENTS];
+
+  while (1){
+    // write out this thread's captured requests before going idle
+    otp_capture_flush_thread();
+    int n = epoll_wait(io->epollFD, events, MAX_EVENTS, -1);
+    if (n < 0){
+      if (errno == EINTR){
+        continue;
+      }
+      otp_log(OTP_LOG_ERROR, LOG_WAIT_FAILED, errno, 0, NULL);
+      return NULL;
+    }
+    for (int i = 0; i < n; i++){
+      void *ptr = events[i].data.ptr;
+      const struct otp_listener *listener = NULL;
+      for (int j = 0; j < io->nlisteners; j++){
+        if (ptr == &io->listeners[j]){
+          listener = &io->listeners[j];
+        }
+      }
+      if (listener != NULL){
+        accept_jobs(io, listener);
+      } else if (ptr == &wake_marker){
+        drain_done(io);
+      } else {
+        struct job *job = ptr;
+        if (job->state == JOB_WRITE){
+          write_job(io, job);
+        } else {
+          read_job(io, job);
+        }
+      }
+    }
+    // handed off and nothing left in flight, this thread is done
+    if (atomic_load(&io->draining) && io->jobs == 0){
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+int run_pool_server(const struct otp_listener *listeners, int nlisteners,
+                    const struct otp_service *const *services, int nservices,
+                    int io_threads, int compute_threads, char *argv[]){
+  if (io_threads < 1 || compute_threads < 1){
+    fprintf(stderr, "SERVER: need at least one I/O and one compute thread\n");
+    return -1;
+  }
+
+  // every I/O thread accepts on its own, so accept must never block
+  int *sockets = malloc(sizeof(int) * nlisteners);
+  for (int i = 0; i < nlisteners; i++){
+    sockets[i] = listeners[i].socket;
+    fcntl(sockets[i], F_SETFL, fcntl(sockets[i], F_GETFL) | O_NONBLOCK);
+  }
+  for (int i = 0; i < BUFFER_CLASSES; i++){
+    pthread_mutex_init(&buffer_classes[i].lock, NULL);
+  }
+
+  // the upgrade signal is taken with sigwait below, so no thread may catch it
+  sigset_t upgrade_set;
+  sigemptyset(&upgrade_set);
+  sigaddset(&upgrade_set, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &upgrade_set, NULL);
+
+  struct compute_pool *pool = calloc(1, sizeof(struct compute_pool));
+  pool->services = services;
+  pool->nservices = nservices;
+  pool->nworkers = compute_threads;
+  pool->deques = calloc(compute_threads, sizeof(struct deque));
+  pthread_mutex_init(&pool->idle_lock, NULL);
+  pthread_cond_init(&pool->idle_cond, NULL);
+
+  struct worker *workers = calloc(compute_threads, sizeof(struct worker));
+  for (int i = 0; i < compute_threads; i++){
+    deque_init(&pool->deques[i]);
+  }
+  for (int i = 0; i < compute_threads; i++){
+    workers[i].pool = pool;
+    workers[i].index = i;
+    if (pthread_create(&workers[i].thread, NULL, compute_thread, &workers[i]) != 0){
+      perror("SERVER: ERROR starting compute thread");
+      return -1;
+    }
+  }
+
+  struct io_thread *ios = calloc(io_threads, sizeof(struct io_thread));
+  for (int i = 0; i < io_threads; i++){
+    struct io_thread *io = &ios[i];
+    io->listeners = listeners;
+    io->nlisteners = nlisteners;
+    io->pool = pool;
+    pthread_mutex_init(&io->done_lock, NULL);
+    io->epollFD = epoll_create1(EPOLL_CLOEXEC);
+    io->wakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (io->epollFD < 0 || io->wakeFD < 0){
+      perror("SERVER: ERROR setting up I/O thread");
+      return -1;
+    }
+
+    // EPOLLEXCLUSIVE wakes one I/O thread per connection, not all of them
+    struct epoll_event ev;
+    for (int j = 0; j < nlisteners; j++){
+      ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+      ev.data.ptr = (void*)&listeners[j];
+      epoll_ctl(io->epollFD, EPOLL_CTL_ADD, listeners[j].socket, &ev);
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wake_marker;
+    epoll_ctl(io->epollFD, EPOLL_CTL_ADD, io->wakeFD, &ev);
+
+    if (pthread_create(&io->thread, NULL, io_thread_main, io) != 0){
+      perror("SERVER: ERROR starting I/O thread");
+      return -1;
+    }
+  }
+
+  announce_ready();
+
+  // serve until a new binary has taken over the listening socket
+  while (1){
+    int sig;
+    sigwait(&upgrade_set, &sig);
+    if (hand_off_listeners(sockets, nlisteners, argv) == 0){
+      break;
+    }
+  }
+
+  // stop accepting and let every I/O thread finish the jobs it holds
+  uint64_t one = 1;
+  for (int i = 0; i < io_threads; i++){
+    for (int j = 0; j < nlisteners; j++){
+      epoll_ctl(ios[i].epollFD, EPOLL_CTL_DEL, sockets[j], NULL);
+    }
+    atomic_store(&ios[i].draining, 1);
+    if (write(ios[i].wakeFD, &one, sizeof(one)) < 0){
+      otp_log(OTP_LOG_ERROR, LOG_WAKE_FAILED, errno, 0, NULL);
+    }
+  }
+  for (int i = 0; i < io_threads; i++){
+    pthread_join(ios[i].thread, NULL);
+  }
+  for (int i = 0; i < nlisteners; i++){
+    close(sockets[i]);
+  }
+  free(sockets);
+  return 0;
+}
+
+volatile sig_atomic_t upgrade_requested = 0;
+
+// the signal mask with SIGUSR2 let through, for waiting on a connection
+static sigset_t wait_mask;
+
+static void upgrade_handler(int sig){
+  upgrade_requested = 1;
+}
+
+void catch_upgrade_signal(void){
+  struct sigaction sa;
+  memset(&sa, '\0', sizeof(sa));
+  sa.sa_handler = upgrade_handler;
+  sigemptyset(&sa.sa_mask);
+  // no SA_RESTART, a blocked wait has to return so the flag gets seen
+  sa.sa_flags = 0;
+  sigaction(SIGUSR2, &sa, NULL);
+
+  // only take it while waiting for a connection, so it can never land
+  // between checking upgrade_requested and blocking in accept
+  sigset_t upgrade_set;
+  sigemptyset(&upgrade_set);
+  sigaddset(&upgrade_set, SIGUSR2);
+  sigprocmask(SIG_BLOCK, &upgrade_set, &wait_mask);
+  sigdelset(&wait_mask, SIGUSR2);
+}
+
+int wait_for_connection(int listenSocket){
+  struct pollfd listener = { listenSocket, POLLIN, 0 };
+  return ppoll(&listener, 1, NULL, &wait_mask) > 0 ? 0 : -1;
+}
+
+int inherited_listen_sockets(int *sockets, int max){
+  char *fds = getenv(LISTEN_FD_ENV);
+  if (fds == NULL){
+    return -1;
+  }
+  // a comma separated list, in the order they were handed off
+  int count = 0;
+  char *next = fds;
+  while (count < max && *next != '\0'){
+    int listenSocket = strtol(next, &next, 10);
+    // make sure it really is a socket we were given
+    int type;
+    socklen_t type_len = sizeof(type);
+    if (getsockopt(listenSocket, SOL_SOCKET, SO_TYPE, &type, &type_len) < 0){
+      break;
+    }
+    fcntl(listenSocket, F_SETFD, FD_CLOEXEC);
+    sockets[count++] = listenSocket;
+    if (*next == ','){
+      next++;
+    }
+  }
+  unsetenv(LISTEN_FD_ENV);
+  return count > 0 ? count : -1;
+}
+
+void announce_ready(void){
+  char *fd = getenv(READY_FD_ENV);
+  if (fd == NULL){
+    return;
+  }
+  int readyFD = atoi(fd);
+  unsetenv(READY_FD_ENV);
+  if (write(readyFD, "r", 1) < 0){
+    perror("SERVER: ERROR announcing ready");
+  }
+  close(readyFD);
+}
+
+int hand_off_listeners(const int *sockets, int count, char *argv[]){
+  int ready[2];
+  char fd[16];
+
+  if (pipe2(ready, O_CLOEXEC) < 0){
+    perror("SERVER: ERROR creating ready pipe");
+    return -1;
+  }
+  // connections queue in the kernel until the new binary starts accepting
+  for (int i = 0; i < count; i++){
+    listen(sockets[i], SOMAXCONN);
+  }
+
+  pid_t childpid = fork();
+  if (childpid < 0){
+    perror("SERVER: ERROR forking new server");
+    close(ready[0]);
+    close(ready[1]);
+    return -1;
+  }
+  if (childpid == 0){
+    // fork again so the new server is not our child and waiting on
+    // the clients we still serve never waits on it
+    if (fork() != 0){
+      _exit(0);
+    }
+    // only the listening sockets and the ready pipe survive the exec
+    char fds[count * sizeof(fd)];
+    fds[0] = '\0';
+    for (int i = 0; i < count; i++){
+      fcntl(sockets[i], F_SETFD, 0);
+      snprintf(fd, sizeof(fd), i > 0 ? ",%d" : "%d", sockets[i]);
+      strcat(fds, fd);
+    }
+    fcntl(ready[1], F_SETFD, 0);
+    setenv(LISTEN_FD_ENV, fds, 1);
+    snprintf(fd, sizeof(fd), "%d", ready[1]);
+    setenv(READY_FD_ENV, fd, 1);
+    execvp(argv[0], argv);
+    perror("SERVER: ERROR starting new server");
+    _exit(1);
+  }
+  while (waitpid(childpid, NULL, 0) < 0 && errno == EINTR);
+
+  // the new server writes one byte once it is serving; if it dies first
+  // the read sees end of file and we carry on as before
+  close(ready[1]);
+  char byte;
+  int n;
+  do {
+    n = read(ready[0], &byte, 1);
+  } while (n < 0 && errno == EINTR);
+  close(ready[0]);
+  if (n != 1){
+    otp_log(OTP_LOG_WARN, LOG_UPGRADE_FAILED, 0, 0, NULL);
+    return -1;
+  }
+  otp_log(OTP_LOG_INFO, LOG_HANDED_OFF, 0, 0, NULL);
+  return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef OTP_SERVER_H
+#define OTP_SERVER_H
+
+#include <signal.h>
+
+// environment a replacement server finds its inherited sockets in
+#define LISTEN_FD_ENV "OTP_LISTEN_FD"
+#define READY_FD_ENV "OTP_READY_FD"
+
+// cipher step for one range: combine len characters of message with
+// the matching characters of key and write the result into out
+typedef void (*otp_range_fn)(const char* message, const char* key, char* out, int len);
+
+// what a server speaks: the handshake byte its clients lead with
+// and the cipher step it runs on their messages
+struct otp_service {
+  char handshake;
+  const char *name;
+  otp_range_fn transform;
+};
+
+// the cipher steps and the services built on them, from otp_cipher.c
+void encript_range(const char* message, const char* key, char* out, int len);
+void decript_range(const char* message, const char* key, char* out, int len);
+extern const struct otp_service enc_service;
+extern const struct otp_service dec_service;
+
+// split a whole job of size bytes: the handshake, the message line and
+// the key line. Returns the length of the message, or -1 if the key has
+// fewer characters than the message.
+int otp_message_len(const char *buffer, int size);
+
+// a listening socket and the service its clients get. A NULL service
+// serves whichever of the pool's services the handshake byte names.
+struct otp_listener {
+  int socket;
+  const struct otp_service *service;
+};
+
+// Serve connections on already listening sockets with io_threads
+// threads doing all socket work and a work-stealing pool of
+// compute_threads threads running the cipher. Every listener shares the
+// same threads and job buffers; services lists what a listener without
+// a service of its own may route to. On SIGUSR2 the sockets are handed
+// to a fresh copy of argv; once that is serving, the jobs in flight are
+// finished and 0 is returned. Returns -1 if the threads could not start.
+int run_pool_server(const struct otp_listener *listeners, int nlisteners,
+                    const struct otp_service *const *services, int nservices,
+                    int io_threads, int compute_threads, char *argv[]);
+
+// Serve connections with workers threads that each own an io_uring and
+// run whole jobs: multishot accept, reads into registered buffers and a
+// send linked to the close, all submitted in batches. sqpoll adds a kernel
+// thread per ring that picks up submissions without a syscall. Handles
+// SIGUSR2 and returns like run_pool_server.
+int run_uring_server(int listenSocket, const struct otp_service *service,
+                     int workers, int sqpoll, char *argv[]);
+
+// Zero-downtime upgrades: SIGUSR2 asks the running server to exec the
+// binary at argv[0] with its listening sockets, so no port ever closes.
+extern volatile sig_atomic_t upgrade_requested;
+
+// set upgrade_requested on SIGUSR2. The signal stays blocked except
+// inside wait_for_connection, which it interrupts
+void catch_upgrade_signal(void);
+
+// block until listenSocket has a connection waiting, returning 0, or
+// until a signal comes in, returning -1
+int wait_for_connection(int listenSocket);
+
+// the listening sockets passed down by the server we replace, in the
+// order it handed them off. Fills at most max and returns how many,
+// or -1 if there were none.
+int inherited_listen_sockets(int *sockets, int max);
+
+// tell the server we replace that we are accepting, so it can drain
+void announce_ready(void);
+
+// start argv with our count listening sockets and wait until it is serving.
+// Returns 0 once it is, or -1 if it could not start and we should go on.
+int hand_off_listeners(const int *sockets, int count, char *argv[]);
+
+#endif
@@ -0,0 +1,575 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+#include "otp_server.h"
+#include "otp_log.h"
+#include "otp_capture.h"
+
+/**
+* io_uring server
+* Every worker thread owns a ring and runs whole jobs on its own: one
+* multishot accept feeds it connections, jobs that fit a slot are read
+* straight into buffers registered with the ring, the cipher runs in
+* place and the answer goes out as a send linked to the close. All the
+* I/O queued while handling one batch of completions is submitted with
+* the same io_uring_enter that waits for the next batch.
+*/
+
+#define RING_ENTRIES 1024
+// registered receive buffers per worker; bigger jobs get malloc'd ones
+#define SLOT_SIZE (64 * 1024)
+#define SLOT_COUNT 128
+// how long an idle SQPOLL thread spins before it has to be woken
+#define SQPOLL_IDLE_MS 1000
+
+enum ujob_state { UJOB_READ_SIZE, UJOB_READ_BODY, UJOB_SENDING };
+
+struct ujob {
+  int fd;
+  enum ujob_state state;
+  int message_size;
+  char *buffer;
+  int slot;              // registered slot holding buffer, -1 if malloc'd
+  int recv_bites;
+  int message_len;
+  int send_failed;
+  uint64_t accepted;
+  uint64_t read_done;
+  uint64_t compute_done;
+  int status;
+};
+
+struct uring {
+  int fd;
+  int sqpoll;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_flags;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  unsigned local_tail;   // SQEs filled in but not yet published
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+struct uring_worker {
+  pthread_t thread;
+  const struct otp_service *service;
+  int listenSocket;
+  int sqpoll;
+  struct uring ring;
+  char *slots;
+  int *free_slots;
+  int nfree;
+  int wakeFD;
+  uint64_t wake_count;
+  int jobs;
+  int accepting;
+  atomic_int draining;
+};
+
+// user_data tags for the completions that are not a job's
+static char accept_marker;
+static char wake_marker;
+// set on a job pointer for the completion of its linked close
+#define CLOSE_TAG 1
+
+// every opcode this file submits. IORING_OP_SOCKET never is, but it
+// arrived in the same release as multishot accept, which has no probe
+// or feature bit of its own
+static const int needed_ops[] = {
+  IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_READ, IORING_OP_READ_FIXED,
+  IORING_OP_SEND, IORING_OP_CLOSE, IORING_OP_ASYNC_CANCEL, IORING_OP_SOCKET,
+};
+
+// ring features the code below relies on: one mapping for both rings,
+// no lost completions and sends that only complete when they fail
+#define NEEDED_FEATURES (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_CQE_SKIP)
+
+// check the kernel can run everything we submit, before serving on it
+static int uring_supported(struct uring *ring, unsigned features){
+  if ((features & NEEDED_FEATURES) != NEEDED_FEATURES){
+    fprintf(stderr, "SERVER: io_uring on this kernel is too old, need 5.19 or later\n");
+    return 0;
+  }
+  struct io_uring_probe *probe = calloc(1, sizeof(struct io_uring_probe) +
+                                        256 * sizeof(struct io_uring_probe_op));
+  int ok = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+  for (int i = 0; ok && i < (int)(sizeof(needed_ops) / sizeof(needed_ops[0])); i++){
+    ok = needed_ops[i] <= probe->last_op &&
+         (probe->ops[needed_ops[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  if (!ok){
+    fprintf(stderr, "SERVER: io_uring on this kernel lacks an operation we need, need 5.19 or later\n");
+  }
+  return ok;
+}
+
+static int uring_setup(struct uring *ring, int sqpoll){
+  struct io_uring_params params;
+  memset(&params, '\0', sizeof(params));
+  if (sqpoll){
+    params.flags = IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = SQPOLL_IDLE_MS;
+  }
+  ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+  if (ring->fd < 0){
+    return -1;
+  }
+  ring->sqpoll = sqpoll;
+  if (!uring_supported(ring, params.features)){
+    close(ring->fd);
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+
+  // the rings share one mapping on any kernel new enough for this file
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  size_t size = sq_size > cq_size ? sq_size : cq_size;
+  char *rings = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring->fd, IORING_OFF_SQ_RING);
+  if (rings == MAP_FAILED){
+    return -1;
+  }
+  ring->sq_head = (unsigned*)(rings + params.sq_off.head);
+  ring->sq_tail = (unsigned*)(rings + params.sq_off.tail);
+  ring->sq_mask = (unsigned*)(rings + params.sq_off.ring_mask);
+  ring->sq_flags = (unsigned*)(rings + params.sq_off.flags);
+  ring->sq_array = (unsigned*)(rings + params.sq_off.array);
+  ring->sq_entries = params.sq_entries;
+  ring->local_tail = *ring->sq_tail;
+  ring->cq_head = (unsigned*)(rings + params.cq_off.head);
+  ring->cq_tail = (unsigned*)(rings + params.cq_off.tail);
+  ring->cq_mask = (unsigned*)(rings + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+
+  ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED){
+    return -1;
+  }
+  return 0;
+}
+
+// hand every filled SQE to the kernel and, if wait is set, block for a completion
+static int uring_enter(struct uring *ring, int wait){
+  unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+  unsigned to_submit = ring->local_tail - *ring->sq_tail;
+  atomic_store_explicit((_Atomic unsigned*)ring->sq_tail, ring->local_tail,
+                        memory_order_release);
+
+  if (ring->sqpoll){
+    // the kernel thread picks up the SQEs itself unless it went to sleep.
+    // It sets NEED_WAKEUP and then looks at the tail once more, so the
+    // tail store above must be seen before we read the flag
+    to_submit = 0;
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit((_Atomic unsigned*)ring->sq_flags, memory_order_acquire)
+        & IORING_SQ_NEED_WAKEUP){
+      flags |= IORING_ENTER_SQ_WAKEUP;
+    }
+    if (flags == 0){
+      return 0;
+    }
+  } else if (to_submit == 0 && !wait){
+    return 0;
+  }
+
+  int n;
+  do {
+    n = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait ? 1 : 0, flags, NULL, 0);
+  } while (n < 0 && errno == EINTR);
+  return n;
+}
+
+// make sure count SQEs can be filled without pushing any to the kernel,
+// so a linked chain is never submitted with only its first half
+static void uring_reserve(struct uring *ring, unsigned count){
+  // out of room, push what we have to the kernel first
+  while (ring->local_tail - atomic_load_explicit((_Atomic unsigned*)ring->sq_head,
+                                                 memory_order_acquire) > ring->sq_entries - count){
+    // publish the tail first, or a SQPOLL thread sees an empty ring,
+    // goes to sleep and never makes room
+    uring_enter(ring, 0);
+    if (ring->sqpoll){
+      syscall(__NR_io_uring_enter, ring->fd, 0, 0, IORING_ENTER_SQ_WAIT, NULL, 0);
+    }
+  }
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *ring){
+  uring_reserve(ring, 1);
+  unsigned index = ring->local_tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, '\0', sizeof(*sqe));
+  ring->sq_array[index] = index;
+  ring->local_tail++;
+  return sqe;
+}
+
+static void queue_accept(struct uring_worker *worker){
+  struct io_uring_sqe *sqe = uring_sqe(&worker->ring);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = worker->listenSocket;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = (uint64_t)(uintptr_t)&accept_marker;
+  worker->accepting = 1;
+}
+
+static void queue_wake_read(struct uring_worker *worker){
+  struct io_uring_sqe *sqe = uring_sqe(&worker->ring);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = worker->wakeFD;
+  sqe->addr = (uint64_t)(uintptr_t)&worker->wake_count;
+  sqe->len = sizeof(worker->wake_count);
+  sqe->user_data = (uint64_t)(uintptr_t)&wake_marker;
+}
+
+static void queue_recv(struct uring_worker *worker, struct ujob *job, void *buffer, int len){
+  struct io_uring_sqe *sqe = uring_sqe(&worker->ring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = job->fd;
+  sqe->addr = (uint64_t)(uintptr_t)buffer;
+  sqe->len = len;
+  sqe->msg_flags = MSG_WAITALL;
+  sqe->user_data = (uint64_t)(uintptr_t)job;
+}
+
+// read the rest of the body; a slot is read with the registered buffer
+static void queue_body_read(struct uring_worker *worker, struct ujob *job){
+  if (job->slot < 0){
+    queue_recv(worker, job, job->buffer + job->recv_bites,
+               job->message_size - job->recv_bites);
+    return;
+  }
+  struct io_uring_sqe *sqe = uring_sqe(&worker->ring);
+  sqe->opcode = IORING_OP_READ_FIXED;
+  sqe->fd = job->fd;
+  sqe->addr = (uint64_t)(uintptr_t)(job->buffer + job->recv_bites);
+  sqe->len = job->message_size - job->recv_bites;
+  sqe->buf_index = 0;
+  sqe->user_data = (uint64_t)(uintptr_t)job;
+}
+
+// send the answer and close the socket right behind it in one submission
+static void queue_send_and_close(struct uring_worker *worker, struct ujob *job,
+                                 char *result, int len){
+  uring_reserve(&worker->ring, 2);
+  struct io_uring_sqe *sqe = uring_sqe(&worker->ring);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = job->fd;
+  sqe->addr = (uint64_t)(uintptr_t)result;
+  sqe->len = len;
+  sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+  // only a failed send needs to tell us anything
+  sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+  sqe->user_data = (uint64_t)(uintptr_t)job;
+
+  sqe = uring_sqe(&worker->ring);
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = job->fd;
+  sqe->user_data = (uint64_t)(uintptr_t)job | CLOSE_TAG;
+  job->state = UJOB_SENDING;
+}
+
+static void free_ujob(struct uring_worker *worker, struct ujob *job){
+  if (otp_capture_enabled()){
+    uint64_t closed = otp_capture_now();
+    struct otp_capture_record record = { 0 };
+    record.arrival_ns = job->accepted;
+    record.message_size = job->state != UJOB_READ_SIZE ? job->message_size : -1;
+    record.message_len = job->compute_done ? job->message_len : -1;
+    record.handshake = job->recv_bites > 0 ? job->buffer[0] : 0;
+    record.status = job->status;
+    if (job->read_done){
+      record.read_us = (job->read_done - job->accepted) / 1000;
+    }
+    if (job->compute_done){
+      record.compute_us = (job->compute_done - job->read_done) / 1000;
+      record.write_us = (closed - job->compute_done) / 1000;
+    }
+    otp_capture(&record);
+  }
+
+  if (job->slot >= 0){
+    worker->free_slots[worker->nfree++] = job->slot;
+  } else {
+    free(job->buffer);
+  }
+  worker->jobs--;
+  free(job);
+}
+
+// close a job we are giving up on outside of the linked close
+static void drop_ujob(struct uring_worker *worker, struct ujob *job){
+  close(job->fd);
+  free_ujob(worker, job);
+}
+
+// the body is in: check it, run the cipher in place and answer
+static void run_ujob(struct uring_worker *worker, struct ujob *job){
+  const struct otp_service *service = worker->service;
+  job->read_done = otp_capture_now();
+  job->status = CAPTURE_REJECTED;
+
+  if (job->buffer[0] != service->handshake){
+    otp_log(OTP_LOG_WARN, LOG_BAD_HANDSHAKE, 0, 0, service->name);
+    drop_ujob(worker, job);
+    return;
+  }
+
+  job->message_len = otp_message_len(job->buffer, job->message_size);
+  if (job->message_len < 0){
+    otp_log(OTP_LOG_WARN, LOG_SHORT_KEY, job->message_size, 0, NULL);
+    drop_ujob(worker, job);
+    return;
+  }
+
+  // each output character only depends on the same position of the
+  // message and key, so the answer can overwrite the message
+  char *message = job->buffer + 1;
+  service->transform(message, message + job->message_len + 1, message, job->message_len);
+  message[job->message_len] = '\n';
+  job->compute_done = otp_capture_now();
+  job->status = CAPTURE_SERVED;
+  queue_send_and_close(worker, job, message, job->message_len + 1);
+}
+
+static void handle_accept(struct uring_worker *worker, struct io_uring_cqe *cqe){
+  if (!(cqe->flags & IORING_CQE_F_MORE)){
+    // the multishot accept ended, put it back unless we are handing off.
+    // EINVAL means the accept itself was refused, so it would only
+    // fail again right away
+    worker->accepting = 0;
+    if (!atomic_load(&worker->draining) && cqe->res != -EINVAL){
+      queue_accept(worker);
+    }
+  }
+  if (cqe->res < 0){
+    if (cqe->res != -ECANCELED){
+      otp_log(OTP_LOG_ERROR, LOG_ACCEPT_FAILED, -cqe->res, 0, NULL);
+    }
+    return;
+  }
+
+  // the accept does not hand back the address, so only ask when it is logged
+  if (otp_log_enabled(OTP_LOG_INFO)){
+    struct sockaddr_in clientAddress;
+    socklen_t sizeOfClientInfo = sizeof(clientAddress);
+    getpeername(cqe->res, (struct sockaddr *)&clientAddress, &sizeOfClientInfo);
+    otp_log(OTP_LOG_INFO, LOG_CONNECTED, ntohl(clientAddress.sin_addr.s_addr),
+            ntohs(clientAddress.sin_port), NULL);
+  }
+
+  struct ujob *job = calloc(1, sizeof(struct ujob));
+  job->fd = cqe->res;
+  job->slot = -1;
+  job->state = UJOB_READ_SIZE;
+  job->accepted = otp_capture_now();
+  job->status = CAPTURE_DROPPED;
+  worker->jobs++;
+  queue_recv(worker, job, &job->message_size, sizeof(job->message_size));
+}
+
+static void handle_job(struct uring_worker *worker, struct ujob *job, int res){
+  if (job->state == UJOB_SENDING){
+    // the send failed; its linked close will come back cancelled
+    otp_log(OTP_LOG_ERROR, LOG_SEND_FAILED, -res, 0, NULL);
+    job->send_failed = 1;
+    job->status = CAPTURE_DROPPED;
+    return;
+  }
+  if (res <= 0){
+    // client went away or the socket failed before the job was in
+    drop_ujob(worker, job);
+    return;
+  }
+
+  if (job->state == UJOB_READ_SIZE){
+    if (res != sizeof(job->message_size) || job->message_size < 2){
+      otp_log(OTP_LOG_WARN, LOG_BAD_SIZE, job->message_size, 0, NULL);
+      job->status = CAPTURE_REJECTED;
+      drop_ujob(worker, job);
+      return;
+    }
+    if (job->message_size <= SLOT_SIZE && worker->nfree > 0){
+      job->slot = worker->free_slots[--worker->nfree];
+      job->buffer = worker->slots + (size_t)job->slot * SLOT_SIZE;
+    } else {
+      job->buffer = malloc(job->message_size);
+    }
+    job->state = UJOB_READ_BODY;
+    queue_body_read(worker, job);
+    return;
+  }
+
+  job->recv_bites += res;
+  if (job->recv_bites < job->message_size){
+    queue_body_read(worker, job);
+    return;
+  }
+  run_ujob(worker, job);
+}
+
+static void handle_close(struct uring_worker *worker, struct ujob *job, int res){
+  if (res < 0){
+    // cancelled because the send failed, so the socket is still open
+    close(job->fd);
+  }
+  free_ujob(worker, job);
+}
+
+static void handle_wake(struct uring_worker *worker, int res){
+  if (atomic_load(&worker->draining)){
+    if (worker->accepting){
+      struct io_uring_sqe *sqe = uring_sqe(&worker->ring);
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = (uint64_t)(uintptr_t)&accept_marker;
+      sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    }
+    return;
+  }
+  queue_wake_read(worker);
+}
+
+static void *uring_worker_main(void *arg){
+  struct uring_worker *worker = arg;
+  struct uring *ring = &worker->ring;
+
+  queue_accept(worker);
+  queue_wake_read(worker);
+
+  // handed off and nothing left in flight, this worker is done
+  while (!(atomic_load(&worker->draining) && worker->jobs == 0 && !worker->accepting)){
+    otp_capture_flush_thread();
+    if (uring_enter(ring, 1) < 0){
+      otp_log(OTP_LOG_ERROR, LOG_WAIT_FAILED, errno, 0, NULL);
+      continue;
+    }
+
+    // reap the whole batch; anything it queues goes out with the next enter
+    unsigned head = *ring->cq_head;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned*)ring->cq_tail, memory_order_acquire);
+    while (head != tail){
+      // give the entry back before handling it, so a handler stuck waiting
+      // for SQ room never leaves the kernel without room to complete into
+      struct io_uring_cqe cqe = ring->cqes[head & *ring->cq_mask];
+      head++;
+      atomic_store_explicit((_Atomic unsigned*)ring->cq_head, head, memory_order_release);
+      uintptr_t data = cqe.user_data;
+
+      if (data == (uintptr_t)&accept_marker){
+        handle_accept(worker, &cqe);
+      } else if (data == (uintptr_t)&wake_marker){
+        handle_wake(worker, cqe.res);
+      } else if (data & CLOSE_TAG){
+        handle_close(worker, (struct ujob*)(data & ~(uintptr_t)CLOSE_TAG), cqe.res);
+      } else if (data != 0){
+        handle_job(worker, (struct ujob*)data, cqe.res);
+      }
+    }
+  }
+  close(ring->fd);
+  return NULL;
+}
+
+int run_uring_server(int listenSocket, const struct otp_service *service,
+                     int workers, int sqpoll, char *argv[]){
+  if (workers < 1){
+    fprintf(stderr, "SERVER: need at least one io_uring worker\n");
+    return -1;
+  }
+
+  // the upgrade signal is taken with sigwait below, so no thread may catch it
+  sigset_t upgrade_set;
+  sigemptyset(&upgrade_set);
+  sigaddset(&upgrade_set, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &upgrade_set, NULL);
+
+  struct uring_worker *all = calloc(workers, sizeof(struct uring_worker));
+  for (int i = 0; i < workers; i++){
+    struct uring_worker *worker = &all[i];
+    worker->service = service;
+    worker->listenSocket = listenSocket;
+    worker->sqpoll = sqpoll;
+    if (uring_setup(&worker->ring, sqpoll) < 0){
+      perror("SERVER: ERROR setting up io_uring");
+      return -1;
+    }
+    worker->wakeFD = eventfd(0, EFD_CLOEXEC);
+    if (worker->wakeFD < 0){
+      perror("SERVER: ERROR setting up io_uring worker");
+      return -1;
+    }
+
+    // pin the receive slots once so the kernel can skip mapping them per read
+    worker->slots = mmap(NULL, (size_t)SLOT_SIZE * SLOT_COUNT, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    worker->free_slots = malloc(sizeof(int) * SLOT_COUNT);
+    struct iovec slots = { worker->slots, (size_t)SLOT_SIZE * SLOT_COUNT };
+    if (worker->slots != MAP_FAILED &&
+        syscall(__NR_io_uring_register, worker->ring.fd, IORING_REGISTER_BUFFERS, &slots, 1) == 0){
+      for (int s = 0; s < SLOT_COUNT; s++){
+        worker->free_slots[s] = s;
+      }
+      worker->nfree = SLOT_COUNT;
+    } else {
+      // every job falls back to its own buffer
+      perror("SERVER: could not register receive buffers");
+      worker->nfree = 0;
+    }
+
+    if (pthread_create(&worker->thread, NULL, uring_worker_main, worker) != 0){
+      perror("SERVER: ERROR starting io_uring worker");
+      return -1;
+    }
+  }
+
+  announce_ready();
+
+  // serve until a new binary has taken over the listening socket
+  while (1){
+    int sig;
+    sigwait(&upgrade_set, &sig);
+    if (hand_off_listeners(&listenSocket, 1, argv) == 0){
+      break;
+    }
+  }
+
+  // cancel every worker's accept and let it finish the jobs it holds
+  uint64_t one = 1;
+  for (int i = 0; i < workers; i++){
+    atomic_store(&all[i].draining, 1);
+    if (write(all[i].wakeFD, &one, sizeof(one)) < 0){
+      otp_log(OTP_LOG_ERROR, LOG_WAKE_FAILED, errno, 0, NULL);
+    }
+  }
+  for (int i = 0; i < workers; i++){
+    pthread_join(all[i].thread, NULL);
+  }
+  close(listenSocket);
+  return 0;
+}
@@ -0,0 +1,379 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include "otp_client.h"
+#include "otp_capture.h"
+
+/**
+* Replay tool
+* 1. Read a capture file written by enc_server/dec_server with OTP_CAPTURE.
+* 2. Send every served request again with made-up content of the same
+*    length, keeping the recorded gaps between arrivals (divided by speed).
+* 3. Print latency percentiles per operation, and optionally save every
+*    latency so two builds can be compared with -c.
+* With -b it skips the capture and keeps a fixed number of same-sized
+* jobs in flight instead, for benchmarking one server mode against another.
+*/
+
+struct replay_job {
+  char op;
+  uint64_t sent_ns;
+  long latency_us;       // -1 if the job failed
+};
+
+static int finished = 0;
+
+uint64_t now_ns(){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+int compare_records(const void *a, const void *b){
+  const struct otp_capture_record *x = a, *y = b;
+  return x->arrival_ns < y->arrival_ns ? -1 : x->arrival_ns > y->arrival_ns;
+}
+
+int compare_longs(const void *a, const void *b){
+  long x = *(const long*)a, y = *(const long*)b;
+  return x < y ? -1 : x > y;
+}
+
+// read every served request out of a capture file, sorted by arrival
+struct otp_capture_record *read_capture(char *file_name, int *count){
+  FILE *file = fopen(file_name, "r");
+  if (file == NULL){
+    perror("REPLAY: ERROR opening capture");
+    exit(1);
+  }
+  char magic[sizeof(CAPTURE_MAGIC)];
+  if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0){
+    fprintf(stderr, "REPLAY: %s is not a capture file\n", file_name);
+    exit(1);
+  }
+
+  int capacity = 1024;
+  struct otp_capture_record *records = malloc(sizeof(*records) * capacity);
+  struct otp_capture_record record;
+  *count = 0;
+  while (fread(&record, sizeof(record), 1, file) == 1){
+    // only requests a server answered can be sent again
+    if (record.status != CAPTURE_SERVED || record.message_len < 0 ||
+        (record.handshake != OTP_ENCRYPT && record.handshake != OTP_DECRYPT)){
+      continue;
+    }
+    if (*count == capacity){
+      capacity *= 2;
+      records = realloc(records, sizeof(*records) * capacity);
+    }
+    records[(*count)++] = record;
+  }
+  fclose(file);
+
+  qsort(records, *count, sizeof(*records), compare_records);
+  return records;
+}
+
+// port or host:port, like the sharded clients take
+int add_server(struct otp_client *client, char *endpoint){
+  char *hostname = "localhost";
+  char *port = endpoint;
+  char *colon = strrchr(endpoint, ':');
+  if (colon != NULL){
+    *colon = '\0';
+    hostname = endpoint;
+    port = colon + 1;
+  }
+  int server = otp_client_add_server(client, hostname, atoi(port));
+  if (server < 0){
+    fprintf(stderr, "REPLAY: ERROR, no such host\n");
+    exit(1);
+  }
+  return server;
+}
+
+void job_done(void *arg, int status, const char *result, int len){
+  struct replay_job *job = arg;
+  job->latency_us = status == 0 ? (long)(now_ns() - job->sent_ns) / 1000 : -1;
+  finished++;
+}
+
+void print_header(){
+  printf("%-4s %8s %7s %9s %9s %9s %9s %9s\n",
+         "op", "count", "failed", "p50_us", "p90_us", "p99_us", "p99.9_us", "max_us");
+}
+
+// print the percentiles of one operation's latencies, sorting them in place
+void print_percentiles(const char *op, long *latencies, int count, int failed){
+  if (count == 0){
+    printf("%-4s %8d %7d\n", op, count, failed);
+    return;
+  }
+  qsort(latencies, count, sizeof(long), compare_longs);
+  printf("%-4s %8d %7d %9ld %9ld %9ld %9ld %9ld\n", op, count, failed,
+         latencies[(int)(0.5 * (count - 1))],
+         latencies[(int)(0.9 * (count - 1))],
+         latencies[(int)(0.99 * (count - 1))],
+         latencies[(int)(0.999 * (count - 1))],
+         latencies[count - 1]);
+}
+
+// read a latency file written by a replay, one "op microseconds" per line
+long *read_latencies(char *file_name, char op, int *count, int *failed){
+  FILE *file = fopen(file_name, "r");
+  if (file == NULL){
+    perror("REPLAY: ERROR opening latencies");
+    exit(1);
+  }
+  int capacity = 1024;
+  long *latencies = malloc(sizeof(long) * capacity);
+  char line_op;
+  long latency;
+  *count = 0;
+  *failed = 0;
+  while (fscanf(file, " %c %ld", &line_op, &latency) == 2){
+    if (line_op != op){
+      continue;
+    }
+    if (latency < 0){
+      (*failed)++;
+      continue;
+    }
+    if (*count == capacity){
+      capacity *= 2;
+      latencies = realloc(latencies, sizeof(long) * capacity);
+    }
+    latencies[(*count)++] = latency;
+  }
+  fclose(file);
+  return latencies;
+}
+
+int compare_runs(char *old_file, char *new_file){
+  char ops[] = { OTP_ENCRYPT, OTP_DECRYPT };
+  char *names[] = { "enc", "dec" };
+
+  for (int i = 0; i < 2; i++){
+    int old_count, old_failed, new_count, new_failed;
+    long *old_latencies = read_latencies(old_file, ops[i], &old_count, &old_failed);
+    long *new_latencies = read_latencies(new_file, ops[i], &new_count, &new_failed);
+    if (old_count == 0 || new_count == 0){
+      free(old_latencies);
+      free(new_latencies);
+      continue;
+    }
+    qsort(old_latencies, old_count, sizeof(long), compare_longs);
+    qsort(new_latencies, new_count, sizeof(long), compare_longs);
+
+    printf("%s: %d/%d requests, %d/%d failed (old/new)\n", names[i],
+           old_count, new_count, old_failed, new_failed);
+    printf("  %-6s %10s %10s %8s\n", "", "old_us", "new_us", "change");
+    double quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1.0 };
+    char *labels[] = { "p50", "p90", "p99", "p99.9", "max" };
+    for (int q = 0; q < 5; q++){
+      long old_us = old_latencies[(int)(quantiles[q] * (old_count - 1))];
+      long new_us = new_latencies[(int)(quantiles[q] * (new_count - 1))];
+      printf("  %-6s %10ld %10ld %+7.1f%%\n", labels[q], old_us, new_us,
+             old_us > 0 ? 100.0 * (new_us - old_us) / old_us : 0.0);
+    }
+    free(old_latencies);
+    free(new_latencies);
+  }
+  return 0;
+}
+
+// closed loop benchmark state: every finished job starts the next one
+struct bench {
+  struct otp_client *client;
+  int server;
+  char *message;
+  char *key;
+  int len;
+  int remaining;
+  struct replay_job *jobs;
+  int next;
+};
+
+static struct bench bench;
+
+void bench_done(void *arg, int status, const char *result, int len){
+  job_done(arg, status, result, len);
+  if (bench.next < bench.remaining){
+    struct replay_job *job = &bench.jobs[bench.next++];
+    job->op = OTP_ENCRYPT;
+    job->sent_ns = now_ns();
+    otp_client_submit(bench.client, bench.server, OTP_ENCRYPT, bench.message,
+                      bench.key, bench.len, bench_done, job);
+  }
+}
+
+int run_bench(int len, int count, int concurrency, char *endpoint){
+  char possible_characters[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+  bench.message = malloc(len + 1);
+  bench.key = malloc(len + 1);
+  for (int i = 0; i < len; i++){
+    bench.message[i] = possible_characters[rand() % 27];
+    bench.key[i] = possible_characters[rand() % 27];
+  }
+  bench.len = len;
+  bench.remaining = count;
+  bench.client = otp_client_new(concurrency);
+  bench.server = add_server(bench.client, endpoint);
+  bench.jobs = calloc(count, sizeof(struct replay_job));
+
+  uint64_t start = now_ns();
+  for (int i = 0; i < concurrency && i < count; i++){
+    struct replay_job *job = &bench.jobs[bench.next++];
+    job->op = OTP_ENCRYPT;
+    job->sent_ns = now_ns();
+    otp_client_submit(bench.client, bench.server, OTP_ENCRYPT, bench.message,
+                      bench.key, len, bench_done, job);
+  }
+  while (finished < count){
+    otp_client_run(bench.client, -1);
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+
+  long *latencies = malloc(sizeof(long) * count);
+  int n = 0;
+  for (int i = 0; i < count; i++){
+    if (bench.jobs[i].latency_us >= 0){
+      latencies[n++] = bench.jobs[i].latency_us;
+    }
+  }
+  printf("%d jobs of %d characters, %d in flight: %.3fs, %.0f jobs/s, %.1f MB/s\n",
+         count, len, concurrency, elapsed, n / elapsed, (double)n * len / elapsed / 1e6);
+  print_header();
+  print_percentiles("enc", latencies, n, count - n);
+
+  free(latencies);
+  free(bench.jobs);
+  free(bench.message);
+  free(bench.key);
+  otp_client_free(bench.client);
+  return 0;
+}
+
+int main(int argc, char *argv[]){
+  if (argc == 4 && strcmp(argv[1], "-c") == 0){
+    return compare_runs(argv[2], argv[3]);
+  }
+  if (argc == 6 && strcmp(argv[1], "-b") == 0){
+    return run_bench(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), argv[5]);
+  }
+  if (argc < 4){
+    fprintf(stderr, "USAGE: %s capture enc_server dec_server [speed [latencies]]\n"
+                    "       %s -c old_latencies new_latencies\n"
+                    "       %s -b length count in_flight enc_server\n",
+                    argv[0], argv[0], argv[0]);
+    exit(1);
+  }
+  double speed = argc > 4 ? atof(argv[4]) : 1.0;
+  if (speed <= 0){
+    fprintf(stderr, "REPLAY: speed must be above zero\n");
+    exit(1);
+  }
+
+  int count;
+  struct otp_capture_record *records = read_capture(argv[1], &count);
+  if (count == 0){
+    fprintf(stderr, "REPLAY: no served requests in %s\n", argv[1]);
+    exit(1);
+  }
+
+  // one random message and key long enough for every request to share
+  int max_len = 0;
+  for (int i = 0; i < count; i++){
+    if (records[i].message_len > max_len){
+      max_len = records[i].message_len;
+    }
+  }
+  char possible_characters[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+  char *message = malloc(max_len + 1);
+  char *key = malloc(max_len + 1);
+  srand(time(NULL));
+  for (int i = 0; i < max_len; i++){
+    message[i] = possible_characters[rand() % 27];
+    key[i] = possible_characters[rand() % 27];
+  }
+
+  struct otp_client *client = otp_client_new(1024);
+  int enc_server = add_server(client, argv[2]);
+  int dec_server = add_server(client, argv[3]);
+  struct replay_job *jobs = calloc(count, sizeof(struct replay_job));
+
+  uint64_t first_arrival = records[0].arrival_ns;
+  uint64_t start = now_ns();
+  int next = 0;
+  while (finished < count){
+    uint64_t now = now_ns();
+    // send everything that is due by now
+    while (next < count && start + (records[next].arrival_ns - first_arrival) / speed <= now){
+      jobs[next].op = records[next].handshake;
+      jobs[next].sent_ns = now_ns();
+      otp_client_submit(client, jobs[next].op == OTP_ENCRYPT ? enc_server : dec_server,
+                        jobs[next].op, message, key, records[next].message_len,
+                        job_done, &jobs[next]);
+      next++;
+    }
+
+    int timeout_ms = -1;
+    if (next < count){
+      uint64_t due = start + (records[next].arrival_ns - first_arrival) / speed;
+      timeout_ms = due > now ? (due - now + 999999) / 1000000 : 0;
+    }
+    if (otp_client_run(client, timeout_ms) == 0 && next < count && timeout_ms > 0){
+      // nothing in flight to wait on, sleep until the next arrival
+      usleep(timeout_ms * 1000);
+    }
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  FILE *out = NULL;
+  if (argc > 5){
+    out = fopen(argv[5], "w");
+    if (out == NULL){
+      perror("REPLAY: ERROR opening latencies");
+      exit(1);
+    }
+  }
+
+  printf("replayed %d requests in %.3fs (captured over %.3fs)\n", count,
+         elapsed / 1e9, (records[count - 1].arrival_ns - first_arrival) / 1e9);
+  print_header();
+  char ops[] = { OTP_ENCRYPT, OTP_DECRYPT };
+  char *names[] = { "enc", "dec" };
+  long *latencies = malloc(sizeof(long) * count);
+  for (int o = 0; o < 2; o++){
+    int n = 0;
+    int failed = 0;
+    for (int i = 0; i < count; i++){
+      if (jobs[i].op != ops[o]){
+        continue;
+      }
+      if (out != NULL){
+        fprintf(out, "%c %ld\n", jobs[i].op, jobs[i].latency_us);
+      }
+      if (jobs[i].latency_us < 0){
+        failed++;
+      } else {
+        latencies[n++] = jobs[i].latency_us;
+      }
+    }
+    print_percentiles(names[o], latencies, n, failed);
+  }
+
+  if (out != NULL){
+    fclose(out);
+  }
+  free(latencies);
+  free(jobs);
+  free(records);
+  free(message);
+  free(key);
+  otp_client_free(client);
+  return 0;
+}